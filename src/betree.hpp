@@ -10,7 +10,11 @@
 // Remove MessageKey type as I think that timestamp field has no sense 
 // actually and the support for concurrency is not currently considered.
 
+#ifndef BETREE_HPP
+#define BETREE_HPP
+
 #include <map>
+#include <algorithm>
 #include <vector>
 #include <cassert>
 #include <cstdint>
@@ -19,9 +23,18 @@
 #include <sstream>
 #include <functional>
 #include <cstddef>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
 #include "debug.hpp"
+#include "perf_counters.hpp"
 
 // The three types of upsert.  An UPDATE specifies a value, v, that
 // will be added (using operator+) to the old value associated to some
@@ -65,56 +78,673 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 #define DEFAULT_MIN_FLUSH_SIZE (DEFAULT_MAX_NODE_SIZE / 16ULL)
 // #define DEFAULT_MIN_FLUSH_SIZE 1
 
+// Splits aim for new nodes holding this fraction of max_node_size.
+// This size split does a good job of causing the resulting nodes to
+// have size between 0.4 * MAX_NODE_SIZE and 0.6 * MAX_NODE_SIZE.
+#define DEFAULT_SPLIT_FILL (10.0 / 24.0)
+
+// In adaptive mode the buffer knobs are recomputed every
+// DEFAULT_ADAPT_INTERVAL upserts from the recent read/write mix.
+// A purely read-heavy workload shrinks the internal buffers down
+// to MIN_BUFFER_FRACTION of max_node_size.
+#define DEFAULT_ADAPT_INTERVAL (1ULL<<14)
+#define MIN_BUFFER_FRACTION (1.0 / 16.0)
+
+// An internal node needs this many children before its byte budget
+// can make it split (see node::is_full).
+#define MIN_BYTE_SPLIT_PIVOTS (4)
+
+// Approximate per-entry cost of a std::map node (colour + three links).
+#define MAP_NODE_OVERHEAD (4 * sizeof(void *))
+
+// query_batch keeps this many independent lookups in flight, so that
+// the prefetch issued for one lookup's next node overlaps with the
+// work done on the others.
+#define PREFETCH_GROUP_SIZE (8)
+
+// After this many consecutive upserts of ever-larger keys, new keys go
+// straight to the rightmost leaf (see node::append).
+#define APPEND_RUN_THRESHOLD (8)
+
+#if defined(__GNUC__)
+#define BETREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BETREE_PREFETCH(addr)
+#endif
+
+// Approximate memory footprint of a key or value, used for the byte
+// budgets.  Specialize it for types that own out-of-line storage.
+template<class T>
+struct betree_footprint {
+    static uint64_t bytes(const T &) {
+        return sizeof(T);
+    }
+};
+
+template<>
+struct betree_footprint<std::string> {
+    static uint64_t bytes(const std::string &s) {
+        return sizeof(std::string) + s.size();
+    }
+};
+
+// Binary encoding of keys and values in checkpoints.  The default
+// copies the object representation; specialize it for types that own
+// out-of-line storage.  supported says whether the encoding is
+// faithful: the default is only for trivially copyable types, and a
+// specialization must set it to true.
+template<class T>
+struct betree_serializer {
+    static const bool supported = std::is_trivially_copyable<T>::value;
+    static void write(std::ostream &out, const T &x) {
+        out.write((const char *)&x, sizeof(T));
+    }
+    static void read(std::istream &in, T &x) {
+        in.read((char *)&x, sizeof(T));
+    }
+};
+
+template<>
+struct betree_serializer<std::string> {
+    static const bool supported = true;
+    static void write(std::ostream &out, const std::string &s) {
+        uint64_t len = s.size();
+        out.write((const char *)&len, sizeof(len));
+        out.write(s.data(), len);
+    }
+    static void read(std::istream &in, std::string &s) {
+        uint64_t len = 0;
+        in.read((char *)&len, sizeof(len));
+        s.resize(len);
+        if (len)
+            in.read(&s[0], len);
+    }
+};
+
+// Keys of a cold leaf (see betree::set_cold_compression) are packed
+// in ascending order, each as a varint of its distance from the one
+// before it (the first from Key()).  Only integral keys can be packed.
+template<class Key, bool = std::is_integral<Key>::value>
+struct betree_key_packer {
+    static const bool supported = false;
+    static void pack(std::string &, const Key &, const Key &) {
+        abort();
+    }
+    static const char *unpack(const char *, const Key &, Key &) {
+        abort();
+    }
+};
+
+template<class Key>
+struct betree_key_packer<Key, true> {
+    static const bool supported = true;
+    static void pack(std::string &out, const Key &prev, const Key &k) {
+        uint64_t d = (uint64_t)k - (uint64_t)prev;
+        while (d >= 0x80) {
+            out.push_back((char)(d | 0x80));
+            d >>= 7;
+        }
+        out.push_back((char)d);
+    }
+    static const char *unpack(const char *p, const Key &prev, Key &k) {
+        uint64_t d = 0;
+        int shift = 0;
+        while ((unsigned char)*p & 0x80) {
+            d |= (uint64_t)((unsigned char)*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        d |= (uint64_t)(unsigned char)*p++ << shift;
+        k = (Key)((uint64_t)prev + d);
+        return p;
+    }
+};
+
+// Whether std::hash<T> is usable, i.e. specialized for T.
+template<class T, class = void>
+struct betree_hashable : std::false_type {};
+
+template<class T>
+struct betree_hashable<T, decltype(void(std::declval<const std::hash<T> &>()(std::declval<const T &>())))>
+    : std::is_default_constructible<std::hash<T> > {};
+
+// A bounded cache of resolved point lookups, sized in bytes (see
+// betree_footprint) and evicted with CLOCK: each entry has a reference
+// bit that a hit sets, and the hand evicts the first entry whose bit
+// is clear, clearing bits as it passes.  Entries remember either a
+// value or that the key is absent.  The betree keeps it consistent by
+// passing every upsert through update().
+template<class Key, class Value> class lookup_cache {
+private:
+    class entry {
+    public:
+        Key key;
+        Value val;
+        bool present;
+        bool referenced;
+        bool used;
+        uint64_t bytes;
+    };
+
+    uint64_t capacity;
+    uint64_t used_bytes;
+    std::vector<entry> slots;
+    std::vector<uint64_t> free_slots;
+    // One hash probe per lookup when std::hash<Key> exists; otherwise
+    // ordered like the tree itself, so keys need no std::hash.
+    typename std::conditional<betree_hashable<Key>::value,
+                              std::unordered_map<Key, uint64_t>,
+                              std::map<Key, uint64_t> >::type index;
+    uint64_t hand;
+
+    static uint64_t entry_bytes(const Key &k, const Value &v) {
+        return MAP_NODE_OVERHEAD + sizeof(entry) - sizeof(Key) - sizeof(Value) +
+               betree_footprint<Key>::bytes(k) + betree_footprint<Value>::bytes(v);
+    }
+
+    void evict(uint64_t slot) {
+        entry &e = slots[slot];
+        index.erase(e.key);
+        used_bytes -= e.bytes;
+        e.used = false;
+        e.val = Value();
+        free_slots.push_back(slot);
+    }
+
+    // Evict until another bytes would fit.
+    void make_room(uint64_t bytes) {
+        while (used_bytes + bytes > capacity && !index.empty()) {
+            hand = (hand + 1) % slots.size();
+            entry &e = slots[hand];
+            if (!e.used)
+                continue;
+            if (e.referenced)
+                e.referenced = false;
+            else
+                evict(hand);
+        }
+    }
+
+public:
+    lookup_cache(uint64_t capacity_bytes)
+      : capacity(capacity_bytes),
+        used_bytes(0),
+        hand(0)
+    {}
+
+    // Return the entry for k, or NULL on a miss.
+    const entry *lookup(const Key &k) {
+        auto it = index.find(k);
+        if (it == index.end())
+            return NULL;
+        entry &e = slots[it->second];
+        e.referenced = true;
+        return &e;
+    }
+
+    // Remember the result of a lookup that missed the cache.
+    void admit(const Key &k, bool present, const Value &v) {
+        uint64_t bytes = entry_bytes(k, v);
+        if (bytes > capacity || index.count(k))
+            return;
+        make_room(bytes);
+        uint64_t slot;
+        if (free_slots.empty()) {
+            slot = slots.size();
+            slots.push_back(entry());
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        entry &e = slots[slot];
+        e.key = k;
+        e.val = v;
+        e.present = present;
+        e.referenced = false;
+        e.used = true;
+        e.bytes = bytes;
+        used_bytes += bytes;
+        index[k] = slot;
+    }
+
+    // A write to k: refresh its entry in place if we have one.  Writes
+    // never admit new keys, so a write-once key cannot push out hot ones.
+    void update(const Key &k, bool present, const Value &v) {
+        auto it = index.find(k);
+        if (it == index.end())
+            return;
+        uint64_t slot = it->second;
+        evict(slot);
+        admit(k, present, v);
+    }
+
+    void clear(void) {
+        slots.clear();
+        free_slots.clear();
+        index.clear();
+        used_bytes = 0;
+        hand = 0;
+    }
+
+    uint64_t size(void) const {
+        return used_bytes;
+    }
+};
+
 template<class Key, class Value> class betree {
 private:
     class node;
     typedef typename std::shared_ptr<node> node_pointer;
 
+    // test/micro_bench.cpp times node operations in isolation.
+    template<class Tree> friend struct betree_node_bench;
+
     uint64_t min_flush_size;
     uint64_t max_node_size;
     uint64_t min_node_size;
+    // Messages an internal node may buffer before it starts flushing
+    // to its children.  The rest of max_node_size is left for pivots,
+    // so this is the buffer vs. fanout (epsilon) tradeoff.
+    uint64_t max_buffer_size;
+    // The buffer size set by set_max_buffer_size; 0 means it follows
+    // max_node_size.
+    uint64_t pinned_buffer_size;
+    double split_fill;
+    // Byte budgets; 0 means unlimited.  A node is full when it
+    // reaches either max_node_size messages or max_node_bytes bytes.
+    uint64_t max_node_bytes;
+    uint64_t max_tree_bytes;
+    // Footprint of every node in the tree, maintained by node::charge.
+    uint64_t total_bytes;
     node_pointer root;
     Value default_value;
 
+    // Workload counters for adaptive mode.  Reads are counted from
+    // const methods, hence mutable.
+    bool adaptive;
+    uint64_t adapt_interval;
+    uint64_t base_min_flush_size;
+    mutable uint64_t nreads;
+    uint64_t nwrites;
+
+    // Augmented mode: maintain live-key counts and the sum of
+    // measure(key, value) for every subtree, see set_augmented.
+    bool augmented;
+    std::function<double(const Key &, const Value &)> measure;
+
+    // Optional cache of point-lookup results, see set_cache_size.
+    std::unique_ptr<lookup_cache<Key, Value> > cache;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    // Optional performance counters, see set_profiling.
+    std::unique_ptr<perf_profiler> profiler;
+
+    // Append detection: the largest key ever upserted and the number
+    // of consecutive upserts that have exceeded it.
+    Key max_key;
+    bool have_max_key;
+    uint64_t append_run;
+
+    // Checkpoints, see checkpoint.  Nodes get an id the first time they
+    // are written; checkpointed maps the id of every node in the last
+    // checkpoint, taken in checkpoint_dir, to the generation whose file
+    // holds its image.
+    uint64_t next_node_id;
+    uint64_t checkpoint_generation;
+    std::string checkpoint_dir;
+    std::map<uint64_t, uint64_t> checkpointed;
+
+    // Cold compression, see set_cold_compression.  cold_clock counts
+    // upserts while it is enabled.  packed_savings is how much less the
+    // packed leaves take than their share of total_bytes.  Reads
+    // unpack leaves, hence mutable.
+    uint64_t cold_age;
+    uint64_t cold_clock;
+    mutable uint64_t packed_leaves;
+    mutable uint64_t packed_savings;
+
     class child_info {
     public:
     child_info(void)
       : child(),
-	    child_size(0)
+	    child_size(0),
+	    child_bytes(0),
+	    live_count(0),
+	    live_sum(0)
     {}
     
-    child_info(node_pointer& child, uint64_t child_size)
-      : child(child),
-	child_size(child_size)
-    {}
+    explicit child_info(node_pointer& child)
+      : child(child)
+    {
+        refresh();
+    }
 
     const child_info& operator =(const child_info& b){
         child = b.child; 
         child_size = b.child_size;
+        child_bytes = b.child_bytes;
+        live_count = b.live_count;
+        live_sum = b.live_sum;
         return *this;
     }
 
     child_info(const child_info& b){
         child = b.child;
         child_size = b.child_size;
+        child_bytes = b.child_bytes;
+        live_count = b.live_count;
+        live_sum = b.live_sum;
+    }
+
+    // Re-read the summary of child.
+    void refresh(void) {
+        child_size = child->size();
+        child_bytes = child->bytes;
+        live_count = child->live_count;
+        live_sum = child->live_sum;
     }
 
     node_pointer child;
     uint64_t child_size;
+    uint64_t child_bytes;
+    // Augmented mode only: live keys in the child's subtree, and the
+    // aggregate of their values.
+    int64_t live_count;
+    double live_sum;
   };
 
     typedef typename std::map<Key, child_info> pivot_map;
     typedef typename std::map<Key, Message<Value> > message_map;
+    // Augmented mode only: how a buffered message changes the number of
+    // live keys (and the aggregate) of the subtree it sits on top of.
+    // Kept beside the messages rather than in them, so that trees that
+    // are not augmented do not pay for it.
+    typedef std::pair<int, double> delta;
+    typedef typename std::map<Key, delta> delta_map;
+    // A message as stored in some node's buffer, handed out without
+    // copying.  It is only valid until the tree is next modified.
+    typedef std::pair<const Key *, const Message<Value> *> message_ref;
+
+    // The entries of a cold leaf: keys by betree_key_packer, values
+    // back to back in betree_serializer encoding.  Leaf entries are
+    // always inserts, so nothing else needs keeping.
+    class packed_leaf {
+    public:
+        uint64_t count;
+        std::string keys;
+        std::string values;
+
+        uint64_t bytes(void) const {
+            return sizeof(packed_leaf) + keys.capacity() + values.capacity();
+        }
+    };
     
     class node {
     public:
         pivot_map pivots;
         message_map elements;
+        // Augmented internal nodes only: the delta of every message in
+        // elements, under the same key.
+        delta_map deltas;
+        // Footprint of pivots, elements and deltas, see betree_footprint.
+        uint64_t bytes;
+        // Augmented mode only: live keys in this subtree (after applying
+        // every message buffered in it) and their aggregate.
+        int64_t live_count;
+        double live_sum;
+        // Checkpoint id (0 until first written), the generation of its
+        // last image, and whether it changed since then.
+        uint64_t id;
+        uint64_t version;
+        bool dirty;
+        // Cold leaves only: the entries, while elements is empty.  Every
+        // read of a leaf's elements goes through unpack first, which
+        // also records the access in last_touch (a cold_clock value).
+        // Packing changes neither bytes nor the dirty bit.
+        mutable std::unique_ptr<packed_leaf> packed;
+        mutable uint64_t last_touch;
+
+        node(void)
+          : bytes(0),
+            live_count(0),
+            live_sum(0),
+            id(0),
+            version(0),
+            dirty(true),
+            packed(),
+            last_touch(0)
+        {}
 
         bool is_leaf(void) const{
             return pivots.empty();
         }
 
+        static uint64_t element_bytes(const Key &k, const Message<Value> &m) {
+            return MAP_NODE_OVERHEAD + betree_footprint<Key>::bytes(k) +
+                   sizeof(Message<Value>) - sizeof(Value) +
+                   betree_footprint<Value>::bytes(m.val);
+        }
+
+        static uint64_t delta_bytes(const Key &k) {
+            return MAP_NODE_OVERHEAD + betree_footprint<Key>::bytes(k) + sizeof(delta);
+        }
+
+        static delta find_delta(const delta_map &dm, const Key &k) {
+            auto it = dm.find(k);
+            return it == dm.end() ? delta(0, 0) : it->second;
+        }
+
+        delta delta_of(const Key &k) const {
+            return find_delta(deltas, k);
+        }
+
+        // The deltas of the messages in [first, last) of elements.
+        delta_map deltas_of(typename message_map::iterator first,
+                            typename message_map::iterator last) const {
+            if (deltas.empty() || first == last)
+                return delta_map();
+            return delta_map(deltas.lower_bound(first->first),
+                             last == elements.end() ? deltas.end() : deltas.lower_bound(last->first));
+        }
+
+        static uint64_t pivot_bytes(const Key &k) {
+            return MAP_NODE_OVERHEAD + betree_footprint<Key>::bytes(k) +
+                   sizeof(child_info);
+        }
+
+        // All changes to pivots and elements go through the helpers
+        // below so that node and tree footprints, the augmented
+        // summaries and the dirty bit stay exact.
+        // Requires: pivots are added to a new internal node before its
+        // elements, since leaf and buffer entries are summarized
+        // differently.
+        void charge(betree &bet, int64_t delta) {
+            bytes += delta;
+            bet.total_bytes += delta;
+            dirty = true;
+            last_touch = bet.cold_clock;
+        }
+
+        // A leaf entry is one live key; a buffered message counts by
+        // its delta, the change it makes to the subtree below it.
+        void tally(const betree &bet, const Key &k, const Message<Value> &m,
+                   const delta &d, int sign) {
+            if (!bet.augmented)
+                return;
+            if (is_leaf()) {
+                live_count += sign;
+                live_sum += sign * bet.measure(k, m.val);
+            } else {
+                live_count += sign * d.first;
+                live_sum += sign * d.second;
+            }
+        }
+
+        void tally(const child_info &ci, int sign) {
+            live_count += sign * ci.live_count;
+            live_sum += sign * ci.live_sum;
+        }
+
+        // d is only kept for messages buffered in an internal node of an
+        // augmented tree.
+        void set_element(betree &bet, const Key &k, const Message<Value> &m,
+                         const delta &d = delta(0, 0)) {
+            auto it = elements.find(k);
+            if (it != elements.end()) {
+                charge(bet, -(int64_t)element_bytes(it->first, it->second));
+                tally(bet, it->first, it->second, delta_of(k), -1);
+                it->second = m;
+            } else {
+                elements.insert(std::make_pair(k, m));
+            }
+            charge(bet, element_bytes(k, m));
+            if (bet.augmented && !is_leaf()) {
+                auto dit = deltas.find(k);
+                if (dit == deltas.end()) {
+                    deltas.insert(std::make_pair(k, d));
+                    charge(bet, delta_bytes(k));
+                } else {
+                    dit->second = d;
+                }
+            }
+            tally(bet, k, m, d, 1);
+        }
+
+        void erase_element(betree &bet, const Key &k) {
+            auto it = elements.find(k);
+            if (it != elements.end()) {
+                charge(bet, -(int64_t)element_bytes(it->first, it->second));
+                tally(bet, it->first, it->second, delta_of(k), -1);
+                elements.erase(it);
+                auto dit = deltas.find(k);
+                if (dit != deltas.end()) {
+                    charge(bet, -(int64_t)delta_bytes(k));
+                    deltas.erase(dit);
+                }
+            }
+        }
+
+        void erase_elements(betree &bet, typename message_map::iterator first,
+                            typename message_map::iterator last) {
+            if (first == last)
+                return;
+            auto dfirst = deltas.lower_bound(first->first);
+            auto dlast = last == elements.end() ? deltas.end() : deltas.lower_bound(last->first);
+            for (auto it = first; it != last; ++it) {
+                charge(bet, -(int64_t)element_bytes(it->first, it->second));
+                tally(bet, it->first, it->second, delta_of(it->first), -1);
+            }
+            for (auto dit = dfirst; dit != dlast; ++dit)
+                charge(bet, -(int64_t)delta_bytes(dit->first));
+            deltas.erase(dfirst, dlast);
+            elements.erase(first, last);
+        }
+
+        void set_pivot(betree &bet, const Key &k, const child_info &ci) {
+            auto it = pivots.find(k);
+            if (it == pivots.end())
+                charge(bet, pivot_bytes(k));
+            else
+                tally(it->second, -1);
+            pivots[k] = ci;
+            tally(ci, 1);
+            dirty = true;
+        }
+
+        void erase_pivot(betree &bet, typename pivot_map::iterator it) {
+            charge(bet, -(int64_t)pivot_bytes(it->first));
+            tally(it->second, -1);
+            pivots.erase(it);
+        }
+
+        // Pick up changes made below the child at it.
+        void refresh_child(typename pivot_map::iterator it) {
+            tally(it->second, -1);
+            it->second.refresh();
+            tally(it->second, 1);
+        }
+
+        void clear(betree &bet) {
+            if (packed) {
+                bet.packed_leaves--;
+                bet.packed_savings -= bytes - packed->bytes();
+                packed.reset();
+            }
+            charge(bet, -(int64_t)bytes);
+            live_count = 0;
+            live_sum = 0;
+            pivots.clear();
+            elements.clear();
+            deltas.clear();
+        }
+
+        uint64_t size(void) const {
+            return pivots.size() + elements.size() + (packed ? packed->count : 0);
+        }
+
+        // Pack this leaf's entries, unless that would not save memory.
+        void pack(betree &bet) {
+            assert(is_leaf() && !packed);
+            std::unique_ptr<packed_leaf> p(new packed_leaf);
+            std::ostringstream values;
+            Key prev = Key();
+            for (auto it = elements.begin(); it != elements.end(); ++it) {
+                betree_key_packer<Key>::pack(p->keys, prev, it->first);
+                betree_serializer<Value>::write(values, it->second.val);
+                prev = it->first;
+            }
+            p->count = elements.size();
+            p->values = values.str();
+            p->keys.shrink_to_fit();
+            if (p->bytes() >= bytes)
+                return;
+            bet.packed_leaves++;
+            bet.packed_savings += bytes - p->bytes();
+            elements.clear();
+            packed = std::move(p);
+        }
+
+        void unpack(const betree &bet) const {
+            last_touch = bet.cold_clock;
+            if (!packed)
+                return;
+            // Nodes are only ever const through a const betree, and
+            // unpacking does not change what the tree holds.
+            message_map &elts = const_cast<node *>(this)->elements;
+            std::istringstream values(packed->values);
+            const char *p = packed->keys.data();
+            Key k = Key();
+            for (uint64_t i = 0; i < packed->count; i++) {
+                Message<Value> m(INSERT, bet.default_value);
+                p = betree_key_packer<Key>::unpack(p, k, k);
+                betree_serializer<Value>::read(values, m.val);
+                elts.insert(elts.end(), std::make_pair(k, m));
+            }
+            bet.packed_leaves--;
+            bet.packed_savings -= bytes - packed->bytes();
+            packed.reset();
+        }
+
+        // Only a leaf with at least two entries, or an internal node
+        // with at least MIN_BYTE_SPLIT_PIVOTS children, can be full by
+        // bytes: a single entry larger than the budget cannot be split
+        // any further, and splitting an internal node into halves with
+        // fewer than two children each would only add levels when the
+        // budget is tiny.
+        bool byte_splittable(void) const {
+            return is_leaf() ? size() >= 2 : pivots.size() >= MIN_BYTE_SPLIT_PIVOTS;
+        }
+
+        bool is_full(const betree &bet) const {
+            return size() >= bet.max_node_size ||
+                   (bet.max_node_bytes && byte_splittable() && bytes >= bet.max_node_bytes);
+        }
+
+        bool is_over_full(const betree &bet) const {
+            return size() > bet.max_node_size ||
+                   (bet.max_node_bytes && byte_splittable() && bytes > bet.max_node_bytes);
+        }
+
         // Return OUT iterator of mp which points 
         // to the subtree contains this key.
         template<class OUT, class IN>
@@ -172,20 +802,42 @@ private:
         // I have no idea in addable value, so i remove
         // paramater default_value and value addition in applying 
         // updates.
-        void apply(const Key &mkey, const Message<Value> &elt) {
+        // d is the message's delta (augmented mode only).
+        void apply(betree &bet, const Key &mkey, const Message<Value> &elt,
+                   const delta &d = delta(0, 0)) {
+            unpack(bet);
+            if (!is_leaf()) {
+                // A newer message replaces an older one for the same
+                // key.  Its delta was taken against our contents with
+                // the older message applied, so the two deltas add up
+                // to the change relative to our children.
+                Message<Value> stored = elt;
+                delta stored_delta = d;
+                auto old = elements.find(mkey);
+                if (old != elements.end()) {
+                    delta old_delta = delta_of(mkey);
+                    stored_delta.first += old_delta.first;
+                    stored_delta.second += old_delta.second;
+                    if (elt.opcode == UPDATE && old->second.opcode == INSERT)
+                        stored.opcode = INSERT;
+                }
+                set_element(bet, mkey, stored, stored_delta);
+                return;
+            }
+
             switch (elt.opcode) {
             case INSERT:
                 //There is no timestamp anymore , so there is no need 
                 // to erase (elements.lower_bound(mkey.range_start()),
                 // elements.upper_bound(mkey.range_end()))
-                elements[mkey] = elt;
+                set_element(bet, mkey, elt);
                 break;
 
             case DELETE:
                 if (!is_leaf())
-                    elements[mkey] = elt;
+                    set_element(bet, mkey, elt);
                 else
-                    elements.erase(mkey);
+                    erase_element(bet, mkey);
                 break;
 
             case UPDATE:
@@ -195,20 +847,20 @@ private:
                 // max element with key <= mkey 
                     iter--;
                 }
-                if (iter == elements.end() || iter->first != mkey){
+                if (iter == elements.end() || !(iter->first == mkey)){
                     // No key equals to mkey.key in this node
                     if (is_leaf()) {
-                        apply(mkey, Message<Value>(INSERT, elt.val));
+                        apply(bet, mkey, Message<Value>(INSERT, elt.val));
                     } else {
-                        elements[mkey] = elt;
+                        set_element(bet, mkey, elt);
                     }
                 }
                 else {
                     assert(iter != elements.end() && iter->first == mkey); // There's Message with m.key in elements
                     if (iter->second.opcode == INSERT) {
-                        apply(mkey, Message<Value>(INSERT, elt.val));	  
+                        apply(bet, mkey, Message<Value>(INSERT, elt.val));	  
                     } else {
-                        elements[mkey] = elt;	      
+                        set_element(bet, mkey, elt);	      
                     }
                 }
             }
@@ -221,35 +873,60 @@ private:
 
         // Requires: there are less than MIN_FLUSH_SIZE things in elements
         //           destined for each child in pivots);
+        // Each new node is closed once it holds its share of either the
+        // things (pivots + elements) or the bytes, whichever comes first.
+        // Always returns at least two nodes, or an empty map, leaving
+        // this node as it is, if it cannot be divided (a leaf with one
+        // entry, or an internal node with one child).
         pivot_map split(betree &bet) {
-            assert(pivots.size() + elements.size() >= bet.max_node_size);
-        // This size split does a good job of causing the resulting
-        // nodes to have size between 0.4 * MAX_NODE_SIZE and 0.6 * MAX_NODE_SIZE.
-            int num_new_leaves =
-                            (pivots.size() + elements.size())  / (10 * bet.max_node_size / 24);
-            int things_per_new_leaf =
-                            (pivots.size() + elements.size() + num_new_leaves - 1) / num_new_leaves; // Rounded up by adding num_new_leaves-1
+            unpack(bet);
+            assert(is_full(bet));
+            if ((is_leaf() ? elements.size() : pivots.size()) < 2)
+                return pivot_map();
+            uint64_t target_size = std::max<uint64_t>(1, bet.split_fill * bet.max_node_size);
+            uint64_t num_new_leaves = std::max<uint64_t>(2, size() / target_size);
+            if (bet.max_node_bytes) {
+                uint64_t target_bytes = std::max<uint64_t>(1, bet.split_fill * bet.max_node_bytes);
+                num_new_leaves = std::max<uint64_t>(num_new_leaves, bytes / target_bytes);
+            }
+            // Leave every new internal node two children where we can.
+            if (!is_leaf())
+                num_new_leaves = std::min<uint64_t>(num_new_leaves,
+                                                    std::max<uint64_t>(2, pivots.size() / 2));
+            uint64_t total_things = size();
+            uint64_t total_bytes = bytes;
 
             pivot_map result;
             auto pivot_idx = pivots.begin();
             auto elt_idx = elements.begin();
-            int things_moved = 0;
-            for (int i = 0; i < num_new_leaves; i++) {
+            uint64_t things_moved = 0;
+            uint64_t bytes_moved = 0;
+            for (uint64_t i = 0; i < num_new_leaves; i++) {
                 if (pivot_idx == pivots.end() && elt_idx == elements.end())
                     break;
                 node_pointer new_node(new node);
-                result[pivot_idx != pivots.end() ? pivot_idx->first : elt_idx->first] = child_info(new_node,
-                                new_node->elements.size() + new_node->pivots.size());
-                while(things_moved < (i+1) * things_per_new_leaf &&
+                result[pivot_idx != pivots.end() ? pivot_idx->first : elt_idx->first] =
+                    child_info(new_node);
+                while(things_moved * num_new_leaves < (i+1) * total_things &&
+                      bytes_moved * num_new_leaves < (i+1) * total_bytes &&
                     (pivot_idx != pivots.end() || elt_idx != elements.end())) {
+                    // The first node never takes the last pivot or leaf
+                    // entry, which may carry most of the things or bytes.
+                    if (i == 0 && things_moved > 0 &&
+                        (pivot_idx != pivots.end() ? std::next(pivot_idx) == pivots.end()
+                                                   : std::next(elt_idx) == elements.end()))
+                        break;
                     if (pivot_idx != pivots.end()) {
-                        new_node->pivots[pivot_idx->first] = pivot_idx->second;
+                        new_node->set_pivot(bet, pivot_idx->first, pivot_idx->second);
+                        bytes_moved += pivot_bytes(pivot_idx->first);
                         ++pivot_idx;                                // (*)
                         things_moved++;
                         auto elt_end = get_element_begin(pivot_idx);//Variable pivot_idx has beened added  one at (*)
                                                                     //If pivot_idx==pivots.end(),get_element_begin will return elements.end(),so all elements in inter-node will never be splitted into one new node without old pivot
                         while (elt_idx != elt_end) {                //(**)
-                            new_node->elements[elt_idx->first] = elt_idx->second;
+                            new_node->set_element(bet, elt_idx->first, elt_idx->second,
+                                                  delta_of(elt_idx->first));
+                            bytes_moved += element_bytes(elt_idx->first, elt_idx->second);
                             ++elt_idx;
                             things_moved++;
                         }
@@ -257,7 +934,8 @@ private:
                         // Must be a leaf
                         // It holds becuase while in (**)
                         assert(pivots.size() == 0); 
-                        new_node->elements[elt_idx->first] = elt_idx->second;
+                        new_node->set_element(bet, elt_idx->first, elt_idx->second);
+                        bytes_moved += element_bytes(elt_idx->first, elt_idx->second);
                         ++elt_idx;
                         things_moved++;	    
                     }
@@ -265,12 +943,11 @@ private:
             }
             
             for (auto it = result.begin(); it != result.end(); ++it)
-                it->second.child_size = it->second.child->elements.size() + it->second.child->pivots.size();
+                it->second.refresh();
             
             assert(pivot_idx == pivots.end());
             assert(elt_idx == elements.end());
-            pivots.clear();
-            elements.clear();
+            clear(bet);
             return result;
         }
 
@@ -279,10 +956,12 @@ private:
 		       typename pivot_map::iterator end) {
             node_pointer new_node(new node);
             for (auto it = begin; it != end; ++it) {
-                new_node->elements.insert(it->second.child->elements.begin(),
-                        it->second.child->elements.end());
-                new_node->pivots.insert(it->second.child->pivots.begin(),
-                        it->second.child->pivots.end());
+                const node &child = *it->second.child;
+                child.unpack(bet);
+                for (auto pit = child.pivots.begin(); pit != child.pivots.end(); ++pit)
+                    new_node->set_pivot(bet, pit->first, pit->second);
+                for (auto eit = child.elements.begin(); eit != child.elements.end(); ++eit)
+                    new_node->set_element(bet, eit->first, eit->second, child.delta_of(eit->first));
             }
             return new_node;
         }
@@ -302,55 +981,355 @@ private:
                 }
                 if (endit != beginit) {
                     node_pointer merged_node = merge(bet, beginit, endit);
-                    for (auto tmp = beginit; tmp != endit; ++tmp) {
-                        tmp->second.child->elements.clear();
-                        tmp->second.child->pivots.clear();
-                    }
+                    for (auto tmp = beginit; tmp != endit; ++tmp)
+                        tmp->second.child->clear(bet);
                     Key key = beginit->first;
-                    pivots.erase(beginit, endit);
-                    pivots[key] = child_info(merged_node, merged_node->pivots.size() + merged_node->elements.size());
+                    while (beginit != endit)
+                        erase_pivot(bet, beginit++);
+                    set_pivot(bet, key, child_info(merged_node));
                     beginit = pivots.lower_bound(key);
                 }
             }
         }
 
-        void flush_max_message_set(betree &bet,
-            typename pivot_map::iterator& first_pivot_idx){
-            while (elements.size() + pivots.size() >= bet.max_node_size) {
-                // Find the child with the largest set of messages in our buffer
-                unsigned int max_size = 0;
+        void flush_max_message_set(betree &bet){
+            while (elements.size() >= bet.max_buffer_size || is_full(bet)) {
+                // Find the child with the largest set of messages in our
+                // buffer, measured in bytes when we have a byte budget.
+                uint64_t max_size = 0;
+                uint64_t max_bytes = 0;
                 auto child_pivot = pivots.begin();
                 auto next_pivot = pivots.begin();
                 for (auto it = pivots.begin(); it != pivots.end(); ++it) {
                     auto it2 = next(it);
                     auto elt_it = get_element_begin(it); 
                     auto elt_it2 = get_element_begin(it2); 
-                    unsigned int dist = distance(elt_it, elt_it2);
-                    if (dist > max_size) {
+                    uint64_t dist = 0;
+                    uint64_t dist_bytes = 0;
+                    for (auto eit = elt_it; eit != elt_it2; ++eit) {
+                        dist++;
+                        if (bet.max_node_bytes)
+                            dist_bytes += element_bytes(eit->first, eit->second);
+                    }
+                    if (bet.max_node_bytes ? dist_bytes > max_bytes : dist > max_size) {
                         child_pivot = it;
                         next_pivot = it2;
                         max_size = dist;
+                        max_bytes = dist_bytes;
                     }
                 }
-                if (max_size <= bet.min_flush_size)
-                    break; // Requires for splits hold.
+                // Requires for splits hold.  The byte threshold mirrors
+                // DEFAULT_MIN_FLUSH_SIZE being 1/16 of a node.
+                if (max_size <= bet.min_flush_size &&
+                    (!bet.max_node_bytes || max_bytes <= bet.max_node_bytes / 16))
+                    break;
+                // One flush per batch moved out of the outermost buffer.
+                perf_scope scope(bet.profiler.get(), PROFILE_FLUSH);
+                // Copying the batch out below hides the child's miss.
+                prefetch(child_pivot->second.child.get());
                 auto elt_child_it = get_element_begin(child_pivot);
                 auto elt_next_it = get_element_begin(next_pivot);
                 message_map child_elts(elt_child_it, elt_next_it);
-                pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
-                elements.erase(elt_child_it, elt_next_it);
+                delta_map child_deltas = deltas_of(elt_child_it, elt_next_it);
+                pivot_map new_children = child_pivot->second.child->flush(bet, child_elts, child_deltas);
+                erase_elements(bet, elt_child_it, elt_next_it);
                 if (!new_children.empty()) {
-                    pivots.erase(child_pivot);
-                    pivots.insert(new_children.begin(), new_children.end());
+                    erase_pivot(bet, child_pivot);
+                    for (auto it = new_children.begin(); it != new_children.end(); ++it)
+                        set_pivot(bet, it->first, it->second);
                 } else {
-                    first_pivot_idx->second.child_size =
-                    child_pivot->second.child->pivots.size() +
-                    child_pivot->second.child->elements.size();
+                    refresh_child(child_pivot);
                 } 
             }   
         }
 
-        pivot_map flush(betree &bet, message_map &elts){  
+        // Append fast path.  Requires: k is larger than every key in
+        // this subtree, buffered messages included, so no message for
+        // k can be pending above the rightmost leaf and it is safe to
+        // apply m there directly.  A full rightmost node is split
+        // 100/0: it keeps everything and a new right sibling starting
+        // at k is returned for the parent to add, so sequential loads
+        // leave full nodes behind instead of half-empty ones.
+        pivot_map append(betree &bet, const Key &k, const Message<Value> &m) {
+            pivot_map result;
+            if (is_leaf()) {
+                if (!is_full(bet)) {
+                    apply(bet, k, m);
+                    return result;
+                }
+                node_pointer tail(new node);
+                tail->apply(bet, k, m);
+                result[k] = child_info(tail);
+                return result;
+            }
+
+            ////////////// Non-leaf
+
+            auto last = std::prev(pivots.end());
+            pivot_map tails = last->second.child->append(bet, k, m);
+            refresh_child(last);
+            for (auto it = tails.begin(); it != tails.end(); ++it)
+                set_pivot(bet, it->first, it->second);
+
+            if (!tails.empty() && is_over_full(bet)) {
+                node_pointer tail(new node);
+                for (auto it = tails.begin(); it != tails.end(); ++it) {
+                    tail->set_pivot(bet, it->first, it->second);
+                    erase_pivot(bet, pivots.find(it->first));
+                }
+                result[tails.begin()->first] = child_info(tail);
+            }
+            return result;
+        }
+
+        // Hand this subtree over to tree to: move its footprint across
+        // and drop its checkpoint identity, which belongs to from.
+        void give_to(betree &from, betree &to) {
+            for (auto it = pivots.begin(); it != pivots.end(); ++it)
+                it->second.child->give_to(from, to);
+            from.total_bytes -= bytes;
+            to.total_bytes += bytes;
+            id = 0;
+            dirty = true;
+        }
+
+        // True if nothing is left under this node but a chain of
+        // single-child nodes ending in an empty leaf.
+        bool is_empty_chain(void) const {
+            const node *n = this;
+            while (n->elements.empty() && n->pivots.size() == 1)
+                n = n->pivots.begin()->second.child.get();
+            return n->elements.empty() && n->pivots.empty();
+        }
+
+        // Drop empty children that have nothing buffered here for them;
+        // their key ranges fold into the previous child.  The last
+        // child is kept, so this node stays internal and every leaf
+        // stays at the same depth; the parent drops the whole chain.
+        void prune_empty_children(betree &bet) {
+            auto it = pivots.begin();
+            while (it != pivots.end() && pivots.size() > 1) {
+                auto next = std::next(it);
+                bool buffered = get_element_begin(it) != get_element_begin(next);
+                if (!buffered && it->second.child->is_empty_chain()) {
+                    // The chain's own pivots still count in bet's footprint.
+                    node_pointer n = it->second.child;
+                    erase_pivot(bet, it);
+                    while (n) {
+                        node_pointer next = n->is_leaf() ? node_pointer() : n->pivots.begin()->second.child;
+                        n->clear(bet);
+                        n = next;
+                    }
+                }
+                it = next;
+            }
+        }
+
+        // Move every key >= k out of this subtree into a new node owned
+        // by right, and return it.  Buffered messages are partitioned
+        // by key as well, which keeps each one above the half of the
+        // boundary child its key falls in, so nothing is flushed: only
+        // the nodes on the path to k are split and whole subtrees
+        // past it change owner.  Either side may come out empty; an
+        // internal node always keeps at least one child (see
+        // prune_empty_children).
+        //
+        // lo, if given, is a key below k that bounds this subtree from
+        // below (the parent's pivot for it).  When every key here is
+        // >= k, the empty chain left behind is re-keyed to it.
+        node_pointer split_at(betree &bet, betree &right, const Key &k, const Key *lo) {
+            node_pointer result(new node);
+            if (is_leaf()) {
+                auto first = elements.lower_bound(k);
+                for (auto it = first; it != elements.end(); ++it)
+                    result->set_element(right, it->first, it->second);
+                erase_elements(bet, first, elements.end());
+                return result;
+            }
+
+            ////////////// Non-leaf
+
+            // The boundary child is split unless k is exactly its
+            // pivot, and so is the first child when every key here is
+            // >= k, to leave this node a child.
+            auto start = pivots.upper_bound(k);
+            auto boundary = start == pivots.begin() ? start : std::prev(start);
+            if (boundary->first < k || boundary == pivots.begin()) {
+                bool below = boundary->first < k;
+                node_pointer tail = boundary->second.child->split_at(bet, right, k,
+                                                                     below ? &boundary->first : lo);
+                refresh_child(boundary);
+                result->set_pivot(right, k, child_info(tail));
+                start = std::next(boundary);
+                if (!below && lo) {
+                    child_info ci = boundary->second;
+                    erase_pivot(bet, boundary);
+                    set_pivot(bet, *lo, ci);
+                }
+            } else {
+                start = boundary;
+            }
+            for (auto it = start; it != pivots.end(); ++it) {
+                it->second.child->give_to(bet, right);
+                result->set_pivot(right, it->first, it->second);
+            }
+            auto first = elements.lower_bound(k);
+            for (auto it = first; it != elements.end(); ++it)
+                result->set_element(right, it->first, it->second, delta_of(it->first));
+            erase_elements(bet, first, elements.end());
+            while (start != pivots.end())
+                erase_pivot(bet, start++);
+
+            prune_empty_children(bet);
+            result->prune_empty_children(right);
+            return result;
+        }
+
+        // Replace the child at it with the nodes it split into.  The
+        // first of them keeps the old pivot, which can be below its
+        // first key when messages for that gap are buffered here.
+        void replace_child(betree &bet, typename pivot_map::iterator it,
+                           const pivot_map &new_children) {
+            Key key = it->first;
+            erase_pivot(bet, it);
+            auto nit = new_children.begin();
+            set_pivot(bet, key, nit->second);
+            for (++nit; nit != new_children.end(); ++nit)
+                set_pivot(bet, nit->first, nit->second);
+        }
+
+        // Attach sub, whose keys are all >= k and larger than any key
+        // here, as the last child of the rightmost node depth levels
+        // down, or sooner if the edge reaches a leaf.  Returns the
+        // nodes replacing this one if it split.
+        pivot_map graft_right(betree &bet, const Key &k, node_pointer &sub, uint64_t depth) {
+            if (depth == 0 || pivots.rbegin()->second.child->is_leaf()) {
+                set_pivot(bet, k, child_info(sub));
+            } else {
+                auto last = std::prev(pivots.end());
+                pivot_map new_children = last->second.child->graft_right(bet, k, sub, depth - 1);
+                if (new_children.empty())
+                    refresh_child(last);
+                else
+                    replace_child(bet, last, new_children);
+            }
+            if (is_over_full(bet))
+                return split(bet);
+            return pivot_map();
+        }
+
+        // Mirror image of graft_right: sub holds keys >= k that are all
+        // smaller than any key here, and becomes the first child of the
+        // leftmost node depth levels down.  The first pivot of every
+        // node on the way is lowered to k.
+        pivot_map graft_left(betree &bet, const Key &k, node_pointer &sub, uint64_t depth) {
+            if (depth == 0 || pivots.begin()->second.child->is_leaf()) {
+                set_pivot(bet, k, child_info(sub));
+            } else {
+                auto first = pivots.begin();
+                pivot_map new_children = first->second.child->graft_left(bet, k, sub, depth - 1);
+                child_info ci = first->second;
+                erase_pivot(bet, first);
+                if (new_children.empty()) {
+                    ci.refresh();
+                    set_pivot(bet, k, ci);
+                } else {
+                    for (auto it = new_children.begin(); it != new_children.end(); ++it)
+                        set_pivot(bet, it->first, it->second);
+                }
+            }
+            if (is_over_full(bet))
+                return split(bet);
+            return pivot_map();
+        }
+
+        // The smallest and largest keys that appear anywhere in this
+        // subtree as a pivot or a message; they are found on its left
+        // and right edges.  Return false if the subtree is empty.
+        bool lowest_key(Key &k) const {
+            bool found = false;
+            for (const node *n = this; n; ) {
+                if (!n->elements.empty() && (!found || n->elements.begin()->first < k)) {
+                    k = n->elements.begin()->first;
+                    found = true;
+                }
+                if (n->is_leaf())
+                    break;
+                if (!found || n->pivots.begin()->first < k) {
+                    k = n->pivots.begin()->first;
+                    found = true;
+                }
+                n = n->pivots.begin()->second.child.get();
+            }
+            return found;
+        }
+
+        bool highest_key(Key &k) const {
+            bool found = false;
+            for (const node *n = this; n; ) {
+                if (!n->elements.empty() && (!found || k < n->elements.rbegin()->first)) {
+                    k = n->elements.rbegin()->first;
+                    found = true;
+                }
+                if (n->is_leaf())
+                    break;
+                if (!found || k < n->pivots.rbegin()->first) {
+                    k = n->pivots.rbegin()->first;
+                    found = true;
+                }
+                n = n->pivots.rbegin()->second.child.get();
+            }
+            return found;
+        }
+
+        // Undo the fragmentation left by split_at along the seam of a
+        // concatenation: every key <= left_max came from the left tree
+        // and every larger key from the right one.  Going down, the two
+        // children either side of the seam are merged, and split again
+        // if that overfills them, so neither side is left underfull.
+        // The first depth levels are the spine above the graft point
+        // (see graft_right and graft_left), which are only descended.
+        // Returns the nodes replacing this one if it split.
+        pivot_map merge_seam(betree &bet, const Key &left_max, uint64_t depth) {
+            if (is_leaf())
+                return is_full(bet) ? split(bet) : pivot_map();
+
+            auto right = pivots.upper_bound(left_max);
+            if (right != pivots.begin()) {
+                auto left = std::prev(right);
+                node_pointer child = left->second.child;
+                bool descend = right == pivots.end() || (depth > 0 && !child->is_leaf());
+                // Leaf entries and buffered messages are summarized
+                // differently, so only nodes of the same kind are merged.
+                if (!descend && child->is_leaf() == right->second.child->is_leaf()) {
+                    node_pointer merged = merge(bet, left, std::next(right));
+                    left->second.child->clear(bet);
+                    right->second.child->clear(bet);
+                    erase_pivot(bet, right);
+                    set_pivot(bet, left->first, child_info(merged));
+                    child = merged;
+                    descend = true;
+                }
+                if (descend) {
+                    pivot_map new_children = child->merge_seam(bet, left_max, depth ? depth - 1 : 0);
+                    if (new_children.empty())
+                        refresh_child(left);
+                    else
+                        replace_child(bet, left, new_children);
+                }
+            }
+            return is_over_full(bet) ? split(bet) : pivot_map();
+        }
+
+        uint64_t height(void) const {
+            uint64_t h = 1;
+            for (const node *n = this; !n->is_leaf(); n = n->pivots.begin()->second.child.get())
+                h++;
+            return h;
+        }
+
+        // elt_deltas holds the deltas of elts (augmented mode only).
+        pivot_map flush(betree &bet, message_map &elts, const delta_map &elt_deltas){  
             debug(std::cout << "Flushing " << this << std::endl);
             pivot_map result;
 
@@ -361,8 +1340,8 @@ private:
 
             if (is_leaf()) {
                 for (auto it = elts.begin(); it != elts.end(); ++it)
-                    apply(it->first, it->second);
-                if (elements.size() + pivots.size() >= bet.max_node_size)
+                    apply(bet, it->first, it->second);
+                if (is_full(bet))
                     result = split(bet);
                 return result;
             }	
@@ -373,23 +1352,22 @@ private:
             Key oldmin = pivots.begin()->first;
             Key newmin = elts.begin()->first;
             if (newmin < oldmin) {
-                pivots[newmin] = pivots[oldmin];
-                pivots.erase(oldmin);
+                set_pivot(bet, newmin, pivots[oldmin]);
+                erase_pivot(bet, pivots.find(oldmin));
             }
 
             // I remove logic for that If everything is going to a single dirty child, go ahead
             // and put it there.
 
             for (auto it = elts.begin(); it != elts.end(); ++it)
-                apply(it->first, it->second);
+                apply(bet, it->first, it->second, find_delta(elt_deltas, it->first));
 
             // Now flush children as necessary
-            auto first_pivot_idx = get_pivot(elts.begin()->first);
-            flush_max_message_set(bet,first_pivot_idx);
+            flush_max_message_set(bet);
             
 
             // We have too many pivots to efficiently flush stuff down, so split
-            if (elements.size() + pivots.size() > bet.max_node_size) {
+            if (is_over_full(bet)) {
                 result = split(bet);
             }
 
@@ -399,80 +1377,343 @@ private:
             return result;
         }
 
-        Value query(const betree & bet, const Key k) const{
+        // Warm n before we search it: both map headers, then the first
+        // entry of each map, which query_step compares k against before
+        // any search and where scans and flushes of the buffer start.
+        // (The red-black root a search starts from is not reachable
+        // through std::map's interface.)  Finding the first entries
+        // reads the headers, so that part waits for n itself; nodes we
+        // may not visit at all get prefetch_headers instead.
+        static void prefetch(const node *n) {
+            prefetch_headers(n);
+            if (!n->pivots.empty())
+                BETREE_PREFETCH(&*n->pivots.begin());
+            if (!n->elements.empty())
+                BETREE_PREFETCH(&*n->elements.begin());
+        }
+
+        static void prefetch_headers(const node *n) {
+            BETREE_PREFETCH(&n->pivots);
+            BETREE_PREFETCH(&n->elements);
+        }
+
+        // One level of a point lookup.  Returns the child to continue
+        // in (already prefetched), or NULL once k is resolved, in which
+        // case v points at the value in place, or is NULL if k does not
+        // exist.
+        const node *query_step(const betree &bet, const Key &k, const Value *&v) const {
             debug(std::cout << "Querying " << this << std::endl);
+            v = NULL;
             if (is_leaf()) {
-                auto it = elements.lower_bound(k);
-                if (it != elements.end() && it->first == k) {
+                unpack(bet);
+                auto it = elements.find(k);
+                if (it != elements.end()) {
                     assert(it->second.opcode == INSERT);
-                    return it->second.val;
-                } else {
-                    throw std::out_of_range("Key does not exist");
+                    v = &it->second.val;
                 }
+                return NULL;
             }
 
             ///////////// Non-leaf
-            
-            auto message_iter = get_element_begin(k);
-            Value v = bet.default_value;
 
-            if (message_iter == elements.end() || k < message_iter->first)
+            auto message_iter = get_element_begin(k);
+            if (message_iter == elements.end() || k < message_iter->first) {
                 // If we don't have any messages for this key, just search
                 // further down the tree.
-                v = get_pivot(k)->second.child->query(bet, k);
-            else if (message_iter->second.opcode == UPDATE) {
-                // Notes::I remove logic of original UPDATA processing as 
-                // I think it's useless or at least uncomprehensive.
-                v = message_iter->second.val;
-            } else if (message_iter->second.opcode == DELETE) {
-                // We have a delete message, so we don't need to look further
-                // down the tree.  
-                throw std::out_of_range("Key does not exist");
-            } else if (message_iter->second.opcode == INSERT) {
-                v = message_iter->second.val;
+                if (k < pivots.begin()->first)
+                    return NULL;
+                const node *child = get_pivot(k)->second.child.get();
+                prefetch(child);
+                return child;
             }
+            // Notes::I remove logic of original UPDATA processing as 
+            // I think it's useless or at least uncomprehensive.
+            // A delete message means we don't need to look further
+            // down the tree.
+            if (message_iter->second.opcode != DELETE)
+                v = &message_iter->second.val;
+            return NULL;
+        }
 
-            return v;
+        Value query(const betree & bet, const Key k) const{
+            const node *n = this;
+            const Value *v = NULL;
+            while (n)
+                n = n->query_step(bet, k, v);
+            if (!v)
+                throw std::out_of_range("Key does not exist");
+            return *v;
         }
 
-        std::pair<Key, Message<Value> >
-        get_next_message_from_children(const Key *mkey) const {
-            auto it = (mkey && pivots.begin()->first < *mkey)
-            ? get_pivot(*mkey): pivots.begin();
-            while (it != pivots.end()) {
-                try {
-                    return it->second.child->get_next_message(mkey);
-                } catch (std::out_of_range e) {}
-                ++it;
+        // Batched query for the sorted, duplicate-free keys in
+        // [first, last).  Keys resolved by a message in this node's
+        // buffer are answered here; the rest are split at the pivots
+        // and handed to each child with a single recursive call, so
+        // every node on the way down is visited once per batch.
+        // Found pairs are appended to result in no particular order.
+        void multi_query(const betree &bet, const Key *first, const Key *last,
+                         std::vector<std::pair<Key, Value> > &result) const {
+            if (is_leaf()) {
+                unpack(bet);
+                for (const Key *k = first; k != last; ++k) {
+                    auto it = elements.find(*k);
+                    if (it != elements.end()) {
+                        assert(it->second.opcode == INSERT);
+                        result.push_back(std::make_pair(*k, it->second.val));
+                    }
+                }
+                return;
+            }
+
+            ///////////// Non-leaf
+
+            std::vector<Key> pending;
+            for (const Key *k = first; k != last; ++k) {
+                auto it = elements.find(*k);
+                if (it == elements.end())
+                    pending.push_back(*k);
+                else if (it->second.opcode != DELETE)
+                    result.push_back(std::make_pair(*k, it->second.val));
+            }
+
+            // Keys smaller than every pivot are not in the tree.
+            auto kit = std::lower_bound(pending.begin(), pending.end(), pivots.begin()->first);
+            if (kit == pending.end())
+                return;
+            auto pit = get_pivot(*kit);
+            while (kit != pending.end()) {
+                auto next = std::next(pit);
+                auto kend = next == pivots.end() ? pending.end() :
+                    std::lower_bound(kit, pending.end(), next->first);
+                auto next_pit = kend == pending.end() ? pivots.end() : get_pivot(*kend);
+                // Pull the next child we will visit towards the cache
+                // while this one is being searched.
+                if (next_pit != pivots.end())
+                    prefetch_headers(next_pit->second.child.get());
+                pit->second.child->multi_query(bet, &*kit, &*kit + (kend - kit), result);
+                kit = kend;
+                pit = next_pit;
             }
-            throw std::out_of_range("No more messages in any children");
         }
-        
-        std::pair<Key, Message<Value> >
-        get_next_message(const Key *mkey) const {
-            auto it = mkey ? elements.upper_bound(*mkey) : elements.begin();
-            // if (it == elements.end()){
-            //     printf("get_next_message: key:%lu\n",*mkey);
-            //     show_elements();
-            // }
+
+        // Augmented mode: add the live keys in [*lo, *hi) (unbounded on
+        // a side whose pointer is NULL) and their aggregate to count and
+        // sum.  Buffered messages contribute their deltas, children
+        // entirely inside the range contribute their summaries, and
+        // only the (at most two) children straddling a bound are
+        // descended into.
+        void summarize(const betree &bet, const Key *lo, const Key *hi,
+                       int64_t &count, double &sum) const {
+            unpack(bet);
+            auto first = lo ? elements.lower_bound(*lo) : elements.begin();
+            auto last = hi ? elements.lower_bound(*hi) : elements.end();
             if (is_leaf()) {
-                if (it == elements.end())
-                    throw std::out_of_range("No more messages in sub-tree");
-                return std::make_pair(it->first, it->second);
+                if (first == elements.begin() && last == elements.end()) {
+                    count += live_count;
+                    sum += live_sum;
+                    return;
+                }
+                for (auto it = first; it != last; ++it) {
+                    count++;
+                    sum += bet.measure(it->first, it->second.val);
+                }
+                return;
             }
 
-            if (it == elements.end())
-                return get_next_message_from_children(mkey);
-        
-            try {
-                auto kids = get_next_message_from_children(mkey);
-                if (kids.first < it->first)
-                    return kids;
-                else 
-                    return std::make_pair(it->first, it->second);
-            }catch (std::out_of_range e) {
-                return std::make_pair(it->first, it->second);	
+            auto dlast = hi ? deltas.lower_bound(*hi) : deltas.end();
+            for (auto dit = lo ? deltas.lower_bound(*lo) : deltas.begin(); dit != dlast; ++dit) {
+                count += dit->second.first;
+                sum += dit->second.second;
+            }
+            auto pit = (lo && pivots.begin()->first < *lo) ? get_pivot(*lo) : pivots.begin();
+            for (; pit != pivots.end(); ++pit) {
+                if (hi && !(pit->first < *hi))
+                    break;
+                auto next = std::next(pit);
+                bool inside = (!lo || !(pit->first < *lo)) &&
+                              (!hi || (next != pivots.end() && !(*hi < next->first)));
+                if (inside) {
+                    count += pit->second.live_count;
+                    sum += pit->second.live_sum;
+                } else {
+                    pit->second.child->summarize(bet, lo, hi, count, sum);
+                }
+            }
+        }
+
+        // Return the first message with key > *mkey, or >= *mkey when
+        // inclusive is set (we have no timestamps to build a range_start
+        // key from, so lower_bound needs this flag).
+        // This is a depth-first walk with an explicit stack rather than
+        // recursion.  Ancestors are visited before their subtrees, so a
+        // message in a higher buffer shadows one for the same key below
+        // it, and a child whose pivot is not below the best key found so
+        // far (nor are any of its right siblings) is never entered.
+        // If hi is given, messages with keys >= *hi are ignored and the
+        // subtrees holding only such keys are skipped.
+        message_ref
+        get_next_message(const betree &bet, const Key *mkey, bool inclusive = false,
+                         const Key *hi = NULL) const {
+            typedef typename message_map::const_iterator message_iter;
+            typedef typename pivot_map::const_iterator pivot_iter;
+            std::vector<std::pair<const node *, pivot_iter> > stack;
+            const node *best_node = NULL;
+            message_iter best;
+
+            const node *n = this;
+            while (n) {
+                n->unpack(bet);
+                auto it = !mkey ? n->elements.begin() :
+                    (inclusive ? n->elements.lower_bound(*mkey) : n->elements.upper_bound(*mkey));
+                if (it != n->elements.end() && (!hi || it->first < *hi) &&
+                    (!best_node || it->first < best->first)) {
+                    best_node = n;
+                    best = it;
+                }
+                if (!n->is_leaf())
+                    stack.push_back(std::make_pair(n, (mkey && n->pivots.begin()->first < *mkey)
+                                                   ? n->get_pivot(*mkey) : n->pivots.begin()));
+
+                n = NULL;
+                while (!stack.empty()) {
+                    const node *parent = stack.back().first;
+                    pivot_iter &pit = stack.back().second;
+                    if (pit == parent->pivots.end() ||
+                        (hi && !(pit->first < *hi)) ||
+                        (best_node && !(pit->first < best->first))) {
+                        stack.pop_back();
+                        continue;
+                    }
+                    n = pit->second.child.get();
+                    ++pit;
+                    // The sibling is where we go if n's subtree has
+                    // nothing for us.
+                    if (pit != parent->pivots.end())
+                        prefetch_headers(pit->second.child.get());
+                    break;
+                }
             }
+
+            if (!best_node)
+                throw std::out_of_range("No more messages in sub-tree");
+            return message_ref(&best->first, &best->second);
+        }
+
+        // Mirror image of get_next_message: return the last message with
+        // key < *mkey (<= when inclusive), ignoring keys < *lo if lo is
+        // given.  Children are walked right to left, and a child is
+        // skipped when the next pivot (its upper bound) is not above
+        // the best key found so far or lo.
+        message_ref
+        get_prev_message(const betree &bet, const Key *mkey, bool inclusive = false,
+                         const Key *lo = NULL) const {
+            typedef typename message_map::const_iterator message_iter;
+            typedef typename pivot_map::const_reverse_iterator pivot_iter;
+            std::vector<std::pair<const node *, pivot_iter> > stack;
+            const node *best_node = NULL;
+            message_iter best;
+
+            const node *n = this;
+            while (n) {
+                n->unpack(bet);
+                auto it = !mkey ? n->elements.end() :
+                    (inclusive ? n->elements.upper_bound(*mkey) : n->elements.lower_bound(*mkey));
+                if (it != n->elements.begin()) {
+                    --it;
+                    if ((!lo || !(it->first < *lo)) &&
+                        (!best_node || best->first < it->first)) {
+                        best_node = n;
+                        best = it;
+                    }
+                }
+                if (!n->is_leaf()) {
+                    pivot_iter start = n->pivots.rbegin();
+                    if (mkey && *mkey < n->pivots.begin()->first)
+                        start = n->pivots.rend();
+                    else if (mkey)
+                        start = pivot_iter(std::next(n->get_pivot(*mkey)));
+                    stack.push_back(std::make_pair(n, start));
+                }
+
+                n = NULL;
+                while (!stack.empty()) {
+                    const node *parent = stack.back().first;
+                    pivot_iter &pit = stack.back().second;
+                    // pit.base() is the pivot after pit, i.e. the
+                    // exclusive upper bound of pit's subtree.
+                    bool bounded = pit != parent->pivots.rend() &&
+                                   pit.base() != parent->pivots.end();
+                    if (pit == parent->pivots.rend() ||
+                        (bounded && lo && !(*lo < pit.base()->first)) ||
+                        (bounded && best_node && !(best->first < pit.base()->first))) {
+                        stack.pop_back();
+                        continue;
+                    }
+                    n = pit->second.child.get();
+                    ++pit;
+                    if (pit != parent->pivots.rend())
+                        prefetch_headers(pit->second.child.get());
+                    break;
+                }
+            }
+
+            if (!best_node)
+                throw std::out_of_range("No more messages in sub-tree");
+            return message_ref(&best->first, &best->second);
+        }
+
+        // Pivot keys with their children's ids, then the messages.  The
+        // children's summaries are recomputed on restore.
+        void serialize(std::ostream &out) const {
+            uint64_t n = pivots.size();
+            betree_serializer<uint64_t>::write(out, n);
+            for (auto it = pivots.begin(); it != pivots.end(); ++it) {
+                betree_serializer<Key>::write(out, it->first);
+                betree_serializer<uint64_t>::write(out, it->second.child->id);
+            }
+            n = elements.size();
+            betree_serializer<uint64_t>::write(out, n);
+            for (auto it = elements.begin(); it != elements.end(); ++it) {
+                delta d = delta_of(it->first);
+                betree_serializer<Key>::write(out, it->first);
+                betree_serializer<int>::write(out, it->second.opcode);
+                betree_serializer<int>::write(out, d.first);
+                betree_serializer<double>::write(out, d.second);
+                betree_serializer<Value>::write(out, it->second.val);
+            }
+        }
+
+        // Write the dirty nodes (all nodes if full) of this subtree as
+        // generation gen and
+        // record every node of it in manifest.  Children go first so
+        // that they have ids by the time this node refers to them.
+        // Clean nodes may sit under dirty ones (append skips the
+        // ancestors of the rightmost leaf), so the whole tree is
+        // walked, but only dirty nodes cost any I/O.
+        uint64_t checkpoint(betree &bet, const std::string &dir, uint64_t gen,
+                            bool full, std::map<uint64_t, uint64_t> &manifest) {
+            uint64_t written = 0;
+            for (auto it = pivots.begin(); it != pivots.end(); ++it)
+                written += it->second.child->checkpoint(bet, dir, gen, full, manifest);
+            if (!id)
+                id = bet.next_node_id++;
+            if (dirty || full) {
+                unpack(bet);
+                std::string file = node_file(dir, id, gen);
+                {
+                    std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+                    serialize(out);
+                    out.flush();
+                    if (!out)
+                        throw std::runtime_error("betree checkpoint: cannot write " + file);
+                }
+                sync_path(file);
+                version = gen;
+                dirty = false;
+                written++;
+            }
+            manifest[id] = version;
+            return written;
         }
 
         void show_elements()const{
@@ -485,13 +1726,212 @@ private:
         }
     };
 
+    static std::string node_file(const std::string &dir, uint64_t id, uint64_t gen) {
+        return dir + "/node." + std::to_string(id) + "." + std::to_string(gen);
+    }
+
+    static std::string manifest_file(const std::string &dir) {
+        return dir + "/manifest";
+    }
+
+    // The default betree_serializer would write the pointers inside,
+    // e.g., a std::vector rather than its elements.
+    static void check_serializable(const std::string &what) {
+        if (!betree_serializer<Key>::supported || !betree_serializer<Value>::supported)
+            throw std::invalid_argument(what + " needs serializable keys and values");
+    }
+
+    // Read the manifest of the checkpoint in dir.  Returns false if
+    // there is none, and throws std::runtime_error if it is truncated.
+    static bool read_manifest(const std::string &dir, uint64_t &gen,
+                              uint64_t &root_id, uint64_t &next_id,
+                              std::map<uint64_t, uint64_t> &manifest) {
+        std::ifstream in(manifest_file(dir).c_str(), std::ios::binary);
+        if (!in)
+            return false;
+        uint64_t n;
+        betree_serializer<uint64_t>::read(in, gen);
+        betree_serializer<uint64_t>::read(in, root_id);
+        betree_serializer<uint64_t>::read(in, next_id);
+        betree_serializer<uint64_t>::read(in, n);
+        for (uint64_t i = 0; i < n && in; i++) {
+            uint64_t id, version;
+            betree_serializer<uint64_t>::read(in, id);
+            betree_serializer<uint64_t>::read(in, version);
+            manifest[id] = version;
+        }
+        if (!in)
+            throw std::runtime_error("betree: truncated manifest in " + dir);
+        return true;
+    }
+
+    // fsync the file or directory at path.  std::ofstream has no way
+    // to do so, hence the POSIX calls on the path.
+    static void sync_path(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("betree checkpoint: cannot open " + path);
+        int err = ::fsync(fd);
+        ::close(fd);
+        if (err)
+            throw std::runtime_error("betree checkpoint: cannot sync " + path);
+    }
+
+    // Rebuild the subtree rooted at node id from the images named in
+    // manifest.  Children are loaded before their parent's pivots are
+    // set so that the summaries in child_info are right.
+    node_pointer load_node(const std::string &dir, uint64_t id,
+                           const std::map<uint64_t, uint64_t> &manifest) {
+        auto mit = manifest.find(id);
+        if (mit == manifest.end())
+            throw std::runtime_error("betree restore: node missing from manifest");
+        std::ifstream in(node_file(dir, id, mit->second).c_str(), std::ios::binary);
+        if (!in)
+            throw std::runtime_error("betree restore: cannot read " +
+                                     node_file(dir, id, mit->second));
+
+        uint64_t n;
+        betree_serializer<uint64_t>::read(in, n);
+        std::vector<std::pair<Key, uint64_t> > children(n);
+        for (uint64_t i = 0; i < n; i++) {
+            betree_serializer<Key>::read(in, children[i].first);
+            betree_serializer<uint64_t>::read(in, children[i].second);
+        }
+        betree_serializer<uint64_t>::read(in, n);
+        std::vector<std::pair<Key, Message<Value> > > messages(n);
+        std::vector<delta> message_deltas(n);
+        for (uint64_t i = 0; i < n; i++) {
+            Message<Value> &m = messages[i].second;
+            betree_serializer<Key>::read(in, messages[i].first);
+            betree_serializer<int>::read(in, m.opcode);
+            betree_serializer<int>::read(in, message_deltas[i].first);
+            betree_serializer<double>::read(in, message_deltas[i].second);
+            betree_serializer<Value>::read(in, m.val);
+        }
+        if (!in)
+            throw std::runtime_error("betree restore: truncated " +
+                                     node_file(dir, id, mit->second));
+        in.close();
+
+        node_pointer result(new node);
+        for (auto it = children.begin(); it != children.end(); ++it) {
+            node_pointer child = load_node(dir, it->second, manifest);
+            result->set_pivot(*this, it->first, child_info(child));
+        }
+        for (uint64_t i = 0; i < messages.size(); i++)
+            result->set_element(*this, messages[i].first, messages[i].second, message_deltas[i]);
+        result->id = id;
+        result->version = mit->second;
+        result->dirty = false;
+        return result;
+    }
+
+    // Re-derive the append detection state after the contents of the
+    // tree were replaced wholesale; the append path relies on max_key
+    // bounding every key in the tree.
+    void reset_append_detection(void) {
+        append_run = 0;
+        have_max_key = root->highest_key(max_key);
+    }
+
+    // Pack every leaf below the root that nothing has touched for
+    // cold_age upserts.  The root is left alone, so small trees are
+    // never packed.
+    void pack_cold_leaves(void) {
+        std::vector<node *> stack;
+        if (!root->is_leaf())
+            stack.push_back(root.get());
+        while (!stack.empty()) {
+            node *n = stack.back();
+            stack.pop_back();
+            for (auto it = n->pivots.begin(); it != n->pivots.end(); ++it) {
+                node *child = it->second.child.get();
+                if (!child->is_leaf())
+                    stack.push_back(child);
+                else if (!child->packed && !child->elements.empty() &&
+                         cold_clock - child->last_touch >= cold_age)
+                    child->pack(*this);
+            }
+        }
+    }
+
+    // Structural operations (split_at, concat) work on plain leaves.
+    void unpack_all(void) {
+        if (!packed_leaves)
+            return;
+        std::vector<node *> stack(1, root.get());
+        while (!stack.empty()) {
+            node *n = stack.back();
+            stack.pop_back();
+            n->unpack(*this);
+            for (auto it = n->pivots.begin(); it != n->pivots.end(); ++it)
+                stack.push_back(it->second.child.get());
+        }
+        assert(!packed_leaves && !packed_savings);
+    }
+
+    // A root with a single child and nothing buffered only adds a level.
+    void collapse_root(void) {
+        while (!root->is_leaf() && root->pivots.size() == 1 && root->elements.empty()) {
+            node_pointer child = root->pivots.begin()->second.child;
+            root->clear(*this);
+            root = child;
+        }
+    }
+
+    void adapt(void) {
+        double write_fraction = (double)nwrites / (nwrites + nreads);
+        double buffer_fraction = MIN_BUFFER_FRACTION +
+                                 (1.0 - MIN_BUFFER_FRACTION) * write_fraction;
+        max_buffer_size = std::max<uint64_t>(1, buffer_fraction * max_node_size);
+        // Keep flushes proportionate to the smaller buffer.
+        min_flush_size = buffer_fraction * base_min_flush_size;
+        // Decay the counters so that they reflect recent history.
+        nwrites /= 2;
+        nreads /= 2;
+    }
+
+    // The buffer size outside adaptive mode.
+    void reset_buffer_size(void) {
+        max_buffer_size = pinned_buffer_size ?
+                          std::min(pinned_buffer_size, max_node_size) : max_node_size;
+    }
+
 public:
     betree(uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
 	    uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
 	    uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE) :
     min_flush_size(minflushsize),
     max_node_size(maxnodesize),
-    min_node_size(minnodesize)
+    min_node_size(minnodesize),
+    max_buffer_size(maxnodesize),
+    pinned_buffer_size(0),
+    split_fill(DEFAULT_SPLIT_FILL),
+    max_node_bytes(0),
+    max_tree_bytes(0),
+    total_bytes(0),
+    adaptive(false),
+    adapt_interval(DEFAULT_ADAPT_INTERVAL),
+    base_min_flush_size(minflushsize),
+    nreads(0),
+    nwrites(0),
+    augmented(false),
+    measure(),
+    cache(),
+    cache_hits(0),
+    cache_misses(0),
+    profiler(),
+    max_key(),
+    have_max_key(false),
+    append_run(0),
+    next_node_id(1),
+    checkpoint_generation(0),
+    checkpoint_dir(),
+    checkpointed(),
+    cold_age(0),
+    cold_clock(0),
+    packed_leaves(0),
+    packed_savings(0)
   {
     root.reset(new node);
   }
@@ -502,12 +1942,63 @@ public:
     // Insert the specified message and handle a split of the root if it
     // occurs.
     void upsert(int opcode, Key k, Value v){
+        perf_scope scope(profiler.get(), PROFILE_UPSERT);
+        if (++nwrites + nreads >= adapt_interval && adaptive)
+            adapt();
+        if (cold_age && ++cold_clock % cold_age == 0)
+            pack_cold_leaves();
         message_map tmp;
         tmp[k] = Message<Value>(opcode, v);
-        pivot_map new_nodes = root->flush(*this, tmp);
+        // Deletes are always let through, they are how space is freed.
+        if (max_tree_bytes && opcode != DELETE &&
+            memory_usage() + node::element_bytes(k, tmp[k]) > max_tree_bytes)
+            throw std::length_error("betree memory limit exceeded");
+        // UPDATE replaces the value, just like INSERT.
+        if (cache)
+            cache->update(k, opcode != DELETE, opcode != DELETE ? v : default_value);
+
+        bool appending = !have_max_key || max_key < k;
+        append_run = appending ? append_run + 1 : 0;
+        if (appending)
+            max_key = k;
+        have_max_key = true;
+
+        if (append_run >= APPEND_RUN_THRESHOLD) {
+            // k has never been seen, so there is nothing to delete.
+            if (opcode == DELETE)
+                return;
+            pivot_map tails = root->append(*this, k, tmp[k]);
+            if (tails.size() > 0) {
+                Key root_min = root->is_leaf() ? root->elements.begin()->first
+                                               : root->pivots.begin()->first;
+                node_pointer old_root = root;
+                root.reset(new node);
+                root->set_pivot(*this, root_min, child_info(old_root));
+                for (auto it = tails.begin(); it != tails.end(); ++it)
+                    root->set_pivot(*this, it->first, it->second);
+            }
+            return;
+        }
+
+        // Appends go straight to a leaf and are summarized on the way
+        // back up, so only a flush needs the delta: in augmented mode
+        // the message records how it changes the live-key count and
+        // aggregate, which needs the current value.
+        delta_map tmp_deltas;
+        if (augmented && !root->is_leaf()) {
+            const node *n = root.get();
+            const Value *old = NULL;
+            while (n)
+                n = n->query_step(*this, k, old);
+            bool exists = opcode != DELETE;
+            tmp_deltas[k] = delta((int)exists - (old != NULL),
+                                  (exists ? measure(k, v) : 0) - (old ? measure(k, *old) : 0));
+        }
+        pivot_map new_nodes = root->flush(*this, tmp, tmp_deltas);
         if (new_nodes.size() > 0) {
             root.reset(new node);
-            root->pivots = new_nodes;
+            for (auto it = new_nodes.begin(); it != new_nodes.end(); ++it)
+                root->set_pivot(*this, it->first, it->second);
         }
     }
 
@@ -523,57 +2014,709 @@ public:
         upsert(DELETE, k, default_value);
     }
     
-    Value query(Key k){
-        Value v = root->query(*this, k);
+    // Zero-copy lookup: a pointer to k's value where the tree stores
+    // it, or NULL if k does not exist.  The pointer is valid until the
+    // next insert, update, erase, split_at, concat or restore.  The
+    // lookup cache is bypassed, as its entries move when it evicts.
+    const Value *find(const Key &k) const {
+        perf_scope scope(profiler.get(), PROFILE_QUERY);
+        nreads++;
+        const node *n = root.get();
+        const Value *v = NULL;
+        while (n)
+            n = n->query_step(*this, k, v);
         return v;
     }
 
+    // Call f(const Value &) on k's value in place.  Returns false,
+    // without calling f, if k does not exist.
+    template<class F>
+    bool visit(const Key &k, F f) const {
+        const Value *v = find(k);
+        if (!v)
+            return false;
+        f(*v);
+        return true;
+    }
+
+    // Call f(const Key &, const Value &) for every key in [lo, hi) in
+    // ascending order, without copying either.  The references are only
+    // valid during the call, and f must not modify the tree.  Returns
+    // the number of keys visited.
+    template<class F>
+    uint64_t scan(const Key &lo, const Key &hi, F f) const {
+        perf_scope scope(profiler.get(), PROFILE_SCAN);
+        nreads++;
+        uint64_t visited = 0;
+        const Key *from = &lo;
+        bool inclusive = true;
+        while (1) {
+            message_ref m;
+            try {
+                m = root->get_next_message(*this, from, inclusive, &hi);
+            } catch (const std::out_of_range &) {
+                break;
+            }
+            // The first message found for a key is its newest one.
+            if (m.second->opcode != DELETE) {
+                f(*m.first, m.second->val);
+                visited++;
+            }
+            from = m.first;
+            inclusive = false;
+        }
+        scope.set_ops(visited);
+        return visited;
+    }
+
+    Value query(Key k){
+        perf_scope scope(profiler.get(), PROFILE_QUERY);
+        nreads++;
+        if (!cache)
+            return root->query(*this, k);
+
+        auto e = cache->lookup(k);
+        if (e) {
+            cache_hits++;
+            if (!e->present)
+                throw std::out_of_range("Key does not exist");
+            return e->val;
+        }
+        cache_misses++;
+        const node *n = root.get();
+        const Value *v = NULL;
+        while (n)
+            n = n->query_step(*this, k, v);
+        cache->admit(k, v != NULL, v ? *v : default_value);
+        if (!v)
+            throw std::out_of_range("Key does not exist");
+        return *v;
+    }
+
+    // Look up keys[i] for every i, with up to PREFETCH_GROUP_SIZE
+    // descents interleaved level by level.  found[i] tells whether
+    // keys[i] exists; values[i] is only meaningful when it does.
+    // Unlike multi_get, results stay in input order and keys need not
+    // share any path, so this suits small, scattered batches.
+    void query_batch(const std::vector<Key> &keys,
+                     std::vector<Value> &values,
+                     std::vector<bool> &found) const {
+        perf_scope scope(profiler.get(), PROFILE_QUERY);
+        scope.set_ops(keys.size());
+        nreads += keys.size();
+        values.assign(keys.size(), default_value);
+        found.assign(keys.size(), false);
+        for (uint64_t base = 0; base < keys.size(); base += PREFETCH_GROUP_SIZE) {
+            uint64_t group = std::min<uint64_t>(PREFETCH_GROUP_SIZE, keys.size() - base);
+            const node *cursors[PREFETCH_GROUP_SIZE];
+            for (uint64_t i = 0; i < group; i++)
+                cursors[i] = root.get();
+            uint64_t active = group;
+            while (active) {
+                for (uint64_t i = 0; i < group; i++) {
+                    if (!cursors[i])
+                        continue;
+                    const Value *v;
+                    cursors[i] = cursors[i]->query_step(*this, keys[base + i], v);
+                    if (!cursors[i]) {
+                        active--;
+                        if (v) {
+                            values[base + i] = *v;
+                            found[base + i] = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Look up many keys with one descent of the tree.  Returns the
+    // (key, value) pairs of the keys that exist, sorted by key; keys
+    // that are not in the tree are simply absent from the result.
+    std::vector<std::pair<Key, Value> > multi_get(std::vector<Key> keys) const {
+        std::vector<std::pair<Key, Value> > result;
+        perf_scope scope(profiler.get(), PROFILE_QUERY);
+        scope.set_ops(keys.size());
+        nreads += keys.size();
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        if (keys.empty())
+            return result;
+        result.reserve(keys.size());
+        root->multi_query(*this, &keys[0], &keys[0] + keys.size(), result);
+        std::sort(result.begin(), result.end(),
+                  [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                      return a.first < b.first;
+                  });
+        return result;
+    }
+
+    // Count hardware events (see perf_counters.hpp) for this thread's
+    // upserts, queries, flushes and scans: one op per upsert, per key
+    // looked up, per batch flushed and per key scanned or iterator
+    // step.  Enabling throws std::runtime_error when no counter can be
+    // opened, and restarts the counts if already enabled.
+    void set_profiling(bool enable) {
+        profiler.reset(enable ? new perf_profiler : NULL);
+    }
+
+    bool is_profiling(void) const {
+        return profiler != NULL;
+    }
+
+    // Requires: profiling is enabled.
+    const perf_profile &get_profile(void) const {
+        assert(profiler);
+        return profiler->get_profile();
+    }
+
+    void reset_profile(void) {
+        if (profiler)
+            profiler->reset();
+    }
+
+    // Live tuning knobs.  They take effect the next time a flush or
+    // split reaches a node; nodes are never rebuilt eagerly.
+    void set_max_node_size(uint64_t size) {
+        assert(size > 0);
+        max_node_size = size;
+        if (adaptive)
+            max_buffer_size = std::min(max_buffer_size, size);
+        else
+            reset_buffer_size();
+    }
+
+    void set_min_node_size(uint64_t size) {
+        min_node_size = size;
+    }
+
+    void set_min_flush_size(uint64_t size) {
+        min_flush_size = base_min_flush_size = size;
+    }
+
+    // The size sticks across set_max_node_size (clamped to the node
+    // size) and set_adaptive(false).
+    void set_max_buffer_size(uint64_t size) {
+        assert(size > 0 && size <= max_node_size);
+        pinned_buffer_size = size;
+        if (!adaptive)
+            max_buffer_size = size;
+    }
+
+    // fill must leave room for at least two nodes per split.
+    void set_split_fill(double fill) {
+        assert(fill > 0.0 && fill <= 0.5);
+        split_fill = fill;
+    }
+
+    // In adaptive mode the internal buffer size follows the write
+    // fraction of the last ~interval operations: write-heavy phases
+    // get large buffers (cheap upserts), read-heavy phases get small
+    // buffers so that messages sit closer to the leaves.
+    void set_adaptive(bool enable, uint64_t interval = DEFAULT_ADAPT_INTERVAL) {
+        assert(interval > 0);
+        adaptive = enable;
+        adapt_interval = interval;
+        if (!enable) {
+            reset_buffer_size();
+            min_flush_size = base_min_flush_size;
+        }
+    }
+
+    // Augmented mode keeps, for every subtree, the number of live keys
+    // and the sum of measure(key, value) over them, so that count,
+    // rank, select and aggregate take one or two root-to-leaf paths
+    // instead of a scan.  Buffered messages carry the change they make
+    // to the subtree below them; computing it costs each upsert a
+    // point lookup.  Only invertible aggregates (sums) can be kept
+    // this way, not min/max.  Requires: the tree is empty.
+    void set_augmented(std::function<double(const Key &, const Value &)> m =
+                           std::function<double(const Key &, const Value &)>()) {
+        assert(root->is_leaf() && root->elements.empty());
+        augmented = true;
+        measure = m ? m : [](const Key &, const Value &) { return 0.0; };
+    }
+
+    bool is_augmented(void) const {
+        return augmented;
+    }
+
+    // Number of keys in the tree.  Requires augmented mode.
+    uint64_t size(void) const {
+        assert(augmented);
+        return root->live_count;
+    }
+
+    // Number of keys in [lo, hi).  Requires augmented mode.
+    uint64_t count(Key lo, Key hi) const {
+        assert(augmented);
+        nreads++;
+        int64_t count = 0;
+        double sum = 0;
+        root->summarize(*this, &lo, &hi, count, sum);
+        return count;
+    }
+
+    // Number of keys smaller than k.  Requires augmented mode.
+    uint64_t rank(Key k) const {
+        assert(augmented);
+        nreads++;
+        int64_t count = 0;
+        double sum = 0;
+        root->summarize(*this, NULL, &k, count, sum);
+        return count;
+    }
+
+    // Sum of measure(key, value) over the keys in [lo, hi).
+    // Requires augmented mode.
+    double aggregate(Key lo, Key hi) const {
+        assert(augmented);
+        nreads++;
+        int64_t count = 0;
+        double sum = 0;
+        root->summarize(*this, &lo, &hi, count, sum);
+        return sum;
+    }
+
+    // The i-th smallest (0-based) key and its value.  Requires
+    // augmented mode.
+    // On the way down we carry the messages buffered above the current
+    // node that fall in its range: their deltas correct the children's
+    // counts, and at the leaf the shallowest one decides whether a key
+    // exists.
+    std::pair<Key, Value> select(uint64_t i) const {
+        assert(augmented);
+        nreads++;
+        if (i >= size())
+            throw std::out_of_range("Rank is past the last key");
+
+        typedef std::pair<int64_t, const Message<Value> *> pending;
+        std::map<Key, pending> overlay;
+        const node *n = root.get();
+        while (!n->is_leaf()) {
+            // deltas has exactly the keys of elements.
+            auto dit = n->deltas.begin();
+            for (auto it = n->elements.begin(); it != n->elements.end(); ++it, ++dit) {
+                auto o = overlay.find(it->first);
+                if (o == overlay.end())
+                    overlay[it->first] = pending(dit->second.first, &it->second);
+                else
+                    o->second.first += dit->second.first;
+            }
+            auto pit = n->pivots.begin();
+            auto oit = overlay.begin();
+            while (1) {
+                auto next = std::next(pit);
+                auto oend = next == n->pivots.end() ? overlay.end() : overlay.lower_bound(next->first);
+                int64_t c = pit->second.live_count;
+                for (auto o = oit; o != oend; ++o)
+                    c += o->second.first;
+                if (i < (uint64_t)c || next == n->pivots.end()) {
+                    overlay.erase(overlay.begin(), oit);
+                    overlay.erase(oend, overlay.end());
+                    n = pit->second.child.get();
+                    break;
+                }
+                i -= c;
+                pit = next;
+                oit = oend;
+            }
+        }
+
+        n->unpack(*this);
+        auto eit = n->elements.begin();
+        auto oit = overlay.begin();
+        while (eit != n->elements.end() || oit != overlay.end()) {
+            bool from_overlay = eit == n->elements.end() ||
+                                (oit != overlay.end() && !(eit->first < oit->first));
+            const Key &k = from_overlay ? oit->first : eit->first;
+            const Message<Value> &m = from_overlay ? *oit->second.second : eit->second;
+            if (from_overlay && eit != n->elements.end() && eit->first == oit->first)
+                ++eit;
+            if (from_overlay)
+                ++oit;
+            else
+                ++eit;
+            if (m.opcode == DELETE)
+                continue;
+            if (i == 0)
+                return std::make_pair(k, m.val);
+            i--;
+        }
+        throw std::out_of_range("Rank is past the last key");
+    }
+
+    // Put a cache of up to bytes bytes of lookup results in front of
+    // query; 0 (the default) removes it.  Hits skip the tree descent
+    // entirely, and upserts keep cached entries exact.
+    void set_cache_size(uint64_t bytes) {
+        if (bytes)
+            cache.reset(new lookup_cache<Key, Value>(bytes));
+        else
+            cache.reset();
+    }
+
+    uint64_t get_cache_hits(void) const { return cache_hits; }
+    uint64_t get_cache_misses(void) const { return cache_misses; }
+
+    // Byte budgets; 0 disables them.  max_node_bytes makes nodes split
+    // and flush on their footprint as well as their message count.
+    // Once the tree's footprint reaches max_tree_bytes, inserts and
+    // updates throw std::length_error until deletes free some space.
+    void set_max_node_bytes(uint64_t bytes) {
+        max_node_bytes = bytes;
+    }
+
+    void set_max_tree_bytes(uint64_t bytes) {
+        max_tree_bytes = bytes;
+    }
+
+    // Approximate memory held by the tree, see betree_footprint.
+    // Packed leaves count at their packed size.
+    uint64_t memory_usage(void) const {
+        return total_bytes - packed_savings;
+    }
+
+    // Cold compression, for integral keys only, and values that are
+    // either trivially copyable or have a betree_serializer
+    // specialization (std::invalid_argument otherwise): the default
+    // serializer would copy the pointers inside, e.g., a std::vector
+    // rather than its elements.  Every age upserts, the leaves that no
+    // upsert, query or scan has touched during the last age upserts
+    // are packed: keys delta encoded by betree_key_packer and values
+    // serialized back to back, instead of a std::map entry each.  The next access to a
+    // packed leaf unpacks the whole leaf again, and it stays unpacked
+    // until it goes cold once more.  Packing happens only inside
+    // upserts, so pointers from find stay valid as documented; reads,
+    // on the other hand, modify packed leaves, so they must not run
+    // concurrently.  age 0 (the default) turns packing off and unpacks
+    // every leaf.
+    void set_cold_compression(uint64_t age) {
+        if (age && !betree_key_packer<Key>::supported)
+            throw std::invalid_argument("betree cold compression needs integral keys");
+        if (age && !betree_serializer<Value>::supported)
+            throw std::invalid_argument("betree cold compression needs serializable values");
+        cold_age = age;
+        if (!age)
+            unpack_all();
+    }
+
+    uint64_t get_cold_compression(void) const {
+        return cold_age;
+    }
+
+    uint64_t get_packed_leaves(void) const {
+        return packed_leaves;
+    }
+
+    // A key that divides the tree roughly in half, for split_at: the
+    // middle pivot of the topmost node with more than one child, or
+    // the middle key of the leaf below if there is no such node.  Keys
+    // are not counted, so the cost is O(height * node size).  Returns
+    // false if that leaf has fewer than two keys.
+    bool split_point(Key &k) const {
+        const node *n = root.get();
+        while (!n->is_leaf() && n->pivots.size() < 2)
+            n = n->pivots.begin()->second.child.get();
+        if (n->is_leaf()) {
+            n->unpack(*this);
+            if (n->elements.size() < 2)
+                return false;
+            auto it = n->elements.begin();
+            std::advance(it, n->elements.size() / 2);
+            k = it->first;
+            return true;
+        }
+        auto it = n->pivots.begin();
+        std::advance(it, n->pivots.size() / 2);
+        k = it->first;
+        return true;
+    }
+
+    // Move every key >= k into right, replacing whatever right held,
+    // and give right this tree's node shape and augmented settings.
+    // Only the nodes on the path to k are split and nothing is
+    // flushed, so the cost is O(height * node size) plus a walk over
+    // the nodes that change owner (not over their keys).
+    void split_at(const Key &k, betree &right) {
+        if (&right == this)
+            throw std::invalid_argument("betree split_at: cannot split into itself");
+        right.max_node_size = max_node_size;
+        right.min_node_size = min_node_size;
+        right.min_flush_size = min_flush_size;
+        right.base_min_flush_size = base_min_flush_size;
+        right.max_buffer_size = max_buffer_size;
+        right.pinned_buffer_size = pinned_buffer_size;
+        right.split_fill = split_fill;
+        right.max_node_bytes = max_node_bytes;
+        right.augmented = augmented;
+        right.measure = measure;
+
+        unpack_all();
+        right.root.reset();
+        right.total_bytes = 0;
+        right.packed_leaves = 0;
+        right.packed_savings = 0;
+        right.root = root->split_at(*this, right, k, NULL);
+        collapse_root();
+        right.collapse_root();
+
+        reset_append_detection();
+        right.reset_append_detection();
+        if (cache)
+            cache->clear();
+        if (right.cache)
+            right.cache->clear();
+    }
+
+    // Append the contents of other, all of whose keys (counting pivots
+    // and pending deletes) must be larger than every key in this tree,
+    // and leave other empty.  The shorter tree is attached as a subtree
+    // at the matching level of the taller one's edge, splitting
+    // upwards as needed, so the cost is O(height * node size) plus a
+    // walk over other's nodes.  Both trees should share a node shape
+    // and augmented settings.
+    void concat(betree &other) {
+        if (&other == this)
+            throw std::invalid_argument("betree concat: cannot concatenate a tree to itself");
+        Key other_min, root_min, root_max;
+        unpack_all();
+        other.unpack_all();
+        if (!other.root->lowest_key(other_min))
+            return;
+        bool empty = !root->highest_key(root_max);
+        if (!empty && !(root_max < other_min))
+            throw std::invalid_argument("betree concat: key ranges overlap");
+
+        node_pointer sub = other.root;
+        sub->give_to(other, *this);
+        other.root.reset(new node);
+        other.reset_append_detection();
+        if (other.cache)
+            other.cache->clear();
+
+        if (empty) {
+            root->clear(*this);
+            root = sub;
+            reset_append_detection();
+            return;
+        }
+
+        uint64_t h = root->height();
+        uint64_t sub_h = sub->height();
+        // Depth of the node that ends up holding both trees.
+        uint64_t seam_depth = 0;
+        root->lowest_key(root_min);
+        pivot_map new_nodes;
+        if (h == sub_h) {
+            new_nodes[root_min] = child_info(root);
+            new_nodes[other_min] = child_info(sub);
+        } else if (h > sub_h) {
+            seam_depth = h - sub_h - 1;
+            new_nodes = root->graft_right(*this, other_min, sub, seam_depth);
+        } else {
+            seam_depth = sub_h - h - 1;
+            new_nodes = sub->graft_left(*this, root_min, root, seam_depth);
+            root = sub;
+        }
+        if (!new_nodes.empty()) {
+            root.reset(new node);
+            for (auto it = new_nodes.begin(); it != new_nodes.end(); ++it)
+                root->set_pivot(*this, it->first, it->second);
+            if (h != sub_h)
+                seam_depth++;
+        }
+
+        new_nodes = root->merge_seam(*this, root_max, seam_depth);
+        if (!new_nodes.empty()) {
+            root.reset(new node);
+            for (auto it = new_nodes.begin(); it != new_nodes.end(); ++it)
+                root->set_pivot(*this, it->first, it->second);
+        }
+        collapse_root();
+        reset_append_detection();
+        if (cache)
+            cache->clear();
+    }
+
+    // Incremental checkpoint into the existing directory dir.  Only the
+    // nodes changed since the previous checkpoint (by flushes, splits,
+    // appends and root replacement) are written, as node.<id>.<gen>;
+    // unchanged nodes keep referring to the files of earlier
+    // generations.  The checkpoint takes effect when the manifest,
+    // which maps every node id to its file, is renamed into place;
+    // files no longer referenced are then removed.  So the cost is
+    // proportional to the writes since the last checkpoint, plus a
+    // manifest entry per node.  The first checkpoint to a directory
+    // writes every node, in a generation above that of any checkpoint
+    // already there, whose files it removes once it has taken effect.
+    // The node files, the manifest and the directory are fsync'd
+    // before the manifest is renamed, and the directory again after,
+    // so a checkpoint is durable once this returns.  Returns the
+    // number of nodes written.  Keys and values must be trivially
+    // copyable or have a betree_serializer specialization
+    // (std::invalid_argument otherwise).
+    uint64_t checkpoint(const std::string &dir) {
+        check_serializable("betree checkpoint");
+        bool full = dir != checkpoint_dir;
+        if (full) {
+            checkpointed.clear();
+            uint64_t old_gen, old_root_id, old_next_id;
+            if (read_manifest(dir, old_gen, old_root_id, old_next_id, checkpointed))
+                checkpoint_generation = std::max(checkpoint_generation, old_gen);
+        }
+        uint64_t gen = ++checkpoint_generation;
+        std::map<uint64_t, uint64_t> manifest;
+        uint64_t written = root->checkpoint(*this, dir, gen, full, manifest);
+
+        std::string tmp = manifest_file(dir) + ".tmp";
+        {
+            std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+            betree_serializer<uint64_t>::write(out, gen);
+            betree_serializer<uint64_t>::write(out, root->id);
+            betree_serializer<uint64_t>::write(out, next_node_id);
+            uint64_t n = manifest.size();
+            betree_serializer<uint64_t>::write(out, n);
+            for (auto it = manifest.begin(); it != manifest.end(); ++it) {
+                betree_serializer<uint64_t>::write(out, it->first);
+                betree_serializer<uint64_t>::write(out, it->second);
+            }
+            out.flush();
+            if (!out)
+                throw std::runtime_error("betree checkpoint: cannot write " + tmp);
+        }
+        sync_path(tmp);
+        sync_path(dir);
+        if (std::rename(tmp.c_str(), manifest_file(dir).c_str()))
+            throw std::runtime_error("betree checkpoint: cannot install manifest in " + dir);
+        sync_path(dir);
+
+        for (auto it = checkpointed.begin(); it != checkpointed.end(); ++it) {
+            auto mit = manifest.find(it->first);
+            if (mit == manifest.end() || mit->second != it->second)
+                std::remove(node_file(dir, it->first, it->second).c_str());
+        }
+        checkpointed.swap(manifest);
+        checkpoint_dir = dir;
+        return written;
+    }
+
+    // Replace the contents of the tree with the last checkpoint in dir.
+    // The tree must be configured as it was when the checkpoint was
+    // taken (in particular set_augmented, whose summaries are rebuilt
+    // with measure).  Later checkpoints to dir continue incrementally.
+    // Keys and values must be serializable as for checkpoint.
+    void restore(const std::string &dir) {
+        check_serializable("betree restore");
+        uint64_t gen, root_id, next_id;
+        std::map<uint64_t, uint64_t> manifest;
+        if (!read_manifest(dir, gen, root_id, next_id, manifest))
+            throw std::runtime_error("betree restore: no checkpoint in " + dir);
+
+        uint64_t old_bytes = total_bytes;
+        total_bytes = 0;
+        node_pointer new_root;
+        try {
+            new_root = load_node(dir, root_id, manifest);
+        } catch (...) {
+            total_bytes = old_bytes;
+            throw;
+        }
+        root = new_root;
+        packed_leaves = 0;
+        packed_savings = 0;
+        checkpoint_generation = gen;
+        next_node_id = next_id;
+        checkpoint_dir = dir;
+        checkpointed.swap(manifest);
+        reset_append_detection();
+        if (cache)
+            cache->clear();
+    }
+
+    uint64_t get_max_node_bytes(void) const { return max_node_bytes; }
+    uint64_t get_max_tree_bytes(void) const { return max_tree_bytes; }
+    uint64_t get_max_node_size(void) const { return max_node_size; }
+    uint64_t get_min_node_size(void) const { return min_node_size; }
+    uint64_t get_min_flush_size(void) const { return min_flush_size; }
+    uint64_t get_max_buffer_size(void) const { return max_buffer_size; }
+    double get_split_fill(void) const { return split_fill; }
+
     void dump_messages(void) {
-        std::pair<Key, Message<Value> > current;
+        message_ref current;
         std::cout << "############### BEGIN DUMP ##############" << std::endl;
         
         try {
-            current = root->get_next_message(NULL);
+            current = root->get_next_message(*this, NULL);
             do { 
-                std::cout << current.first     << " "
-                    << current.second.opcode   << " "
-                    << current.second.val      << std::endl;
-                current = root->get_next_message(&current.first);
+                std::cout << *current.first         << " "
+                    << current.second->opcode   << " "
+                    << current.second->val      << std::endl;
+                current = root->get_next_message(*this, current.first);
             } while (1);
         } catch (std::out_of_range e) {}
     }
 
+    // Iterators walk forward or backward and may carry a bound: a
+    // forward iterator stops before keys >= bound, a reverse one stops
+    // before keys < bound.  The bound is pushed down into
+    // get_next_message/get_prev_message so subtrees outside the range
+    // are never visited.
     class iterator {
         const betree &bet;
-        std::pair<Key, Message<Value> > position;
+        // Where the next step resumes: the key of the last message
+        // applied (or the starting key), copied so that the tree may
+        // change between steps.  Messages are only read in place while
+        // a step runs.
+        Key next;
+        bool have_next;
+        bool next_inclusive;
         bool is_valid;
         bool pos_is_valid;
+        bool forward;
+        bool bounded;
+        Key bound;
+
+        message_ref fetch(const Key *mkey, bool inclusive) const {
+            if (forward)
+                return bet.root->get_next_message(bet, mkey, inclusive, bounded ? &bound : NULL);
+            return bet.root->get_prev_message(bet, mkey, inclusive, bounded ? &bound : NULL);
+        }
+
     public:
         Key first;
         Value second;
 
         iterator(const betree &bet)
         : bet(bet),
-            position(),
+            next(),
+            have_next(false),
+            next_inclusive(true),
             is_valid(false),
             pos_is_valid(false),
+            forward(true),
+            bounded(false),
+            bound(),
             first(),
             second()
         {}
 
-        iterator(const betree &bet, const Key *mkey)
+        iterator(const betree &bet, const Key *mkey, bool forward = true,
+                 const Key *limit = NULL)
         : bet(bet),
-            position(),	
+            next(mkey ? *mkey : Key()),
+            have_next(mkey != NULL),
+            next_inclusive(true),
             is_valid(false),
-            pos_is_valid(false),
+            pos_is_valid(true),
+            forward(forward),
+            bounded(limit != NULL),
+            bound(limit ? *limit : Key()),
             first(),
             second()
         {
-            try {
-                position = bet.root->get_next_message(mkey);
-                pos_is_valid = true;
-                setup_next_element();
-            } catch (std::out_of_range e) {}
+            perf_scope scope(bet.profiler.get(), PROFILE_SCAN);
+            setup_next_element();
         }
 
         void apply(const Key &msgkey, const Message<Value> &msg) {
@@ -601,13 +2744,18 @@ public:
 
         void setup_next_element(void) {
             is_valid = false;
-            while (pos_is_valid && (!is_valid || position.first == first)) {
-                apply(position.first, position.second);
+            while (pos_is_valid && !is_valid) {
+                message_ref position;
                 try {
-                    position = bet.root->get_next_message(&position.first);
-                } catch (std::exception e) {
+                    position = fetch(have_next ? &next : NULL, next_inclusive);
+                } catch (const std::out_of_range &) {
                     pos_is_valid = false;
+                    break;
                 }
+                apply(*position.first, *position.second);
+                next = *position.first;
+                have_next = true;
+                next_inclusive = false;
             }
         }
 
@@ -615,7 +2763,6 @@ public:
             return &bet == &other.bet &&
             is_valid == other.is_valid &&
             pos_is_valid == other.pos_is_valid &&
-            (!pos_is_valid || position == other.position) &&
             (!is_valid || (first == other.first && second == other.second));
         }
 
@@ -624,21 +2771,53 @@ public:
         }
 
         iterator &operator++(void) {
+            perf_scope scope(bet.profiler.get(), PROFILE_SCAN);
             setup_next_element();
             return *this;
         }
     };
 
     iterator begin(void) const {
+        nreads++;
         return iterator(*this, NULL);
     }
 
     iterator lower_bound(Key key) const {
+        nreads++;
         return iterator(*this, &key);
     }
 
+    // Keys in [lo, hi), ascending.
+    iterator range(Key lo, Key hi) const {
+        nreads++;
+        return iterator(*this, &lo, true, &hi);
+    }
+
+    // All keys, descending.
+    iterator rbegin(void) const {
+        nreads++;
+        return iterator(*this, NULL, false);
+    }
+
+    // Keys <= key, descending.
+    iterator reverse_lower_bound(Key key) const {
+        nreads++;
+        return iterator(*this, &key, false);
+    }
+
+    // Keys in [lo, hi), descending.
+    iterator reverse_range(Key lo, Key hi) const {
+        nreads++;
+        iterator it(*this, &hi, false, &lo);
+        // Positioning is inclusive; step past hi itself.
+        if (it != end() && !(it.first < hi))
+            ++it;
+        return it;
+    }
     
     iterator end(void) const {
         return iterator(*this);
     }
-};
\ No newline at end of file
+};
+
+#endif // BETREE_HPP
@@ -0,0 +1,271 @@
+// Optional hardware performance counters for profiling betree
+// operations.
+//
+// perf_counters opens one Linux perf_event_open counter per event for
+// the calling thread (user space only) and reads them all at once.
+// Events the machine or kernel does not support, e.g. hardware events
+// inside most VMs, are simply reported as unavailable; it is an error
+// only if no event at all can be opened.  Counters are opened one by
+// one rather than as a group, so that a missing event never takes the
+// others down with it, and each reading is scaled by
+// time_enabled / time_running in case the kernel multiplexes them.
+//
+// perf_profiler attributes the counts to operation types.  A
+// perf_scope placed at the top of an operation reads the counters on
+// entry and exit and adds the difference to that operation type; a
+// scope nested inside another of the same type (a flush inside a
+// flush) does nothing, so counts are inclusive and never doubled.
+// Scopes of different types do nest: an upsert's counts include the
+// flushes it triggered, which are also reported under PROFILE_FLUSH.
+//
+// Each scope reads every counter twice, one read(2) per counter, so
+// the counts of short operations such as point queries include a
+// noticeable fixed cost; compare them against each other rather than
+// in absolute terms.  Only the thread that enabled profiling is
+// measured, and a profiler must not be shared by concurrent
+// operations.
+
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define PERF_CYCLES (0)
+#define PERF_INSTRUCTIONS (1)
+#define PERF_LLC_MISSES (2)
+#define PERF_BRANCH_MISSES (3)
+#define PERF_DTLB_MISSES (4)
+// Software event, in ns; available even where the PMU is not.
+#define PERF_TASK_CLOCK (5)
+#define PERF_NUM_COUNTERS (6)
+
+#define PROFILE_UPSERT (0)
+#define PROFILE_QUERY (1)
+#define PROFILE_FLUSH (2)
+#define PROFILE_SCAN (3)
+#define PROFILE_NUM_OPS (4)
+
+static const char *const perf_counter_names[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "llc-misses", "branch-misses", "dtlb-misses", "task-clock"
+};
+
+static const char *const profile_op_names[PROFILE_NUM_OPS] = {
+    "upsert", "query", "flush", "scan"
+};
+
+class perf_counters {
+public:
+    perf_counters(void) {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+            fds[i] = -1;
+    }
+
+    ~perf_counters() {
+        close();
+    }
+
+    // Open every supported event and start counting.  Returns the
+    // number of events opened.
+    int open(void) {
+        close();
+        int opened = 0;
+#if defined(__linux__)
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            describe(i, attr);
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] >= 0)
+                opened++;
+        }
+#endif
+        return opened;
+    }
+
+    void close(void) {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            if (fds[i] >= 0)
+                ::close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+
+    bool available(int counter) const {
+        return fds[counter] >= 0;
+    }
+
+    // Current value of every counter; unavailable ones read as 0.
+    void read(uint64_t values[PERF_NUM_COUNTERS]) const {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            values[i] = 0;
+            uint64_t buf[3];
+            if (fds[i] < 0 || ::read(fds[i], buf, sizeof(buf)) != sizeof(buf) || !buf[2])
+                continue;
+            values[i] = buf[2] == buf[1] ? buf[0] : (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+        }
+    }
+
+private:
+    int fds[PERF_NUM_COUNTERS];
+
+#if defined(__linux__)
+    static void describe(int counter, struct perf_event_attr &attr) {
+        switch (counter) {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_TASK_CLOCK:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_TASK_CLOCK;
+            break;
+        }
+    }
+#endif
+
+    perf_counters(const perf_counters &);
+    perf_counters &operator=(const perf_counters &);
+};
+
+// Totals per operation type.
+class perf_profile {
+public:
+    perf_profile(void) {
+        clear();
+    }
+
+    void clear(void) {
+        memset(ops, 0, sizeof(ops));
+        memset(counts, 0, sizeof(counts));
+        memset(available, 0, sizeof(available));
+    }
+
+    // One line per operation type that ran, with per-op averages.
+    void print(std::ostream &out) const {
+        out << "# profile: op count";
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+            out << " " << perf_counter_names[c] << "/op";
+        out << std::endl;
+        for (int op = 0; op < PROFILE_NUM_OPS; op++) {
+            if (!ops[op])
+                continue;
+            out << "# profile: " << profile_op_names[op] << " " << ops[op];
+            for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+                if (available[c])
+                    out << " " << (double)counts[op][c] / ops[op];
+                else
+                    out << " n/a";
+            }
+            out << std::endl;
+        }
+    }
+
+    uint64_t ops[PROFILE_NUM_OPS];
+    uint64_t counts[PROFILE_NUM_OPS][PERF_NUM_COUNTERS];
+    bool available[PERF_NUM_COUNTERS];
+};
+
+class perf_profiler {
+public:
+    // Throws std::runtime_error if no counter can be opened.
+    perf_profiler(void)
+      : active(0)
+    {
+        if (!counters.open())
+            throw std::runtime_error("perf_event_open: no performance counters available");
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+            profile.available[c] = counters.available(c);
+    }
+
+    const perf_profile &get_profile(void) const {
+        return profile;
+    }
+
+    void reset(void) {
+        bool available[PERF_NUM_COUNTERS];
+        memcpy(available, profile.available, sizeof(available));
+        profile.clear();
+        memcpy(profile.available, available, sizeof(available));
+    }
+
+private:
+    friend class perf_scope;
+
+    perf_counters counters;
+    perf_profile profile;
+    // Bit op is set while a scope of type op is open.
+    unsigned active;
+};
+
+class perf_scope {
+public:
+    perf_scope(perf_profiler *p, int op)
+      : profiler(p && !(p->active & (1u << op)) ? p : NULL),
+        op(op),
+        ops(1)
+    {
+        if (!profiler)
+            return;
+        profiler->active |= 1u << op;
+        profiler->counters.read(start);
+    }
+
+    ~perf_scope() {
+        if (!profiler)
+            return;
+        uint64_t end[PERF_NUM_COUNTERS];
+        profiler->counters.read(end);
+        // Scaled readings can step backwards slightly.
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+            if (end[c] > start[c])
+                profiler->profile.counts[op][c] += end[c] - start[c];
+        profiler->profile.ops[op] += ops;
+        profiler->active &= ~(1u << op);
+    }
+
+    // Count this scope as n operations instead of one.
+    void set_ops(uint64_t n) {
+        ops = n;
+    }
+
+private:
+    perf_profiler *profiler;
+    int op;
+    uint64_t ops;
+    uint64_t start[PERF_NUM_COUNTERS];
+
+    perf_scope(const perf_scope &);
+    perf_scope &operator=(const perf_scope &);
+};
+
+#endif // PERF_COUNTERS_HPP
@@ -0,0 +1,463 @@
+// A partitioned front-end over several independent betrees.
+//
+// Every betree funnels its writes through a single root buffer, so
+// one tree cannot scale writes across cores.  sharded_betree splits
+// the key space over N betrees (shards), each guarded by its own
+// mutex, so that upserts to different shards never contend.
+//
+// Two partitioning schemes are supported:
+// - RANGE_PARTITIONED: shard i owns keys in [bounds[i-1], bounds[i]).
+//   Iteration simply walks the shards in order, and a shard that
+//   receives more than split_threshold upserts is split in two near
+//   its middle key (up to max_shards shards).
+// - HASH_PARTITIONED: shard is std::hash<Key>(k) % nshards.  Hot
+//   ranges are spread by the hash, so shards are never split.
+//   Iteration does a k-way merge over the shards.
+//
+// Point operations are thread-safe.  Routing a key to its shard takes
+// no lock: the shard directory is an immutable snapshot, replaced as
+// a whole when a shard splits.  Iterators are not thread-safe: like
+// the betree iterator, they must not be used while writers are
+// running.
+
+#ifndef SHARDED_BETREE_HPP
+#define SHARDED_BETREE_HPP
+
+#include <algorithm>
+#include <mutex>
+#include "betree.hpp"
+
+#define RANGE_PARTITIONED (0)
+#define HASH_PARTITIONED (1)
+
+// Number of upserts a range shard may absorb before it is split.
+#define DEFAULT_SHARD_SPLIT_THRESHOLD (1ULL<<20)
+#define DEFAULT_MAX_SHARDS (64)
+
+template<class Key, class Value> class sharded_betree {
+private:
+    typedef betree<Key, Value> tree_type;
+
+    class shard {
+    public:
+        shard(uint64_t maxnodesize, uint64_t minnodesize, uint64_t minflushsize)
+          : tree(maxnodesize, minnodesize, minflushsize),
+            upserts(0),
+            retired(false)
+        {}
+
+        std::mutex lock;
+        tree_type tree;
+        // Upserts since this shard was created; drives hot-shard splits.
+        uint64_t upserts;
+        // Set once a split has replaced this shard in the directory.
+        // Operations that routed here before the split must re-route.
+        bool retired;
+    };
+    typedef typename std::shared_ptr<shard> shard_pointer;
+
+    int mode;
+    uint64_t max_node_size;
+    uint64_t min_node_size;
+    uint64_t min_flush_size;
+    uint64_t split_threshold;
+    uint64_t max_shards;
+
+    // The routing table.  It is never modified once published:
+    // readers take a snapshot with std::atomic_load, and a split
+    // publishes a new one with std::atomic_store.
+    class directory {
+    public:
+        std::vector<shard_pointer> shards;
+        // Only used for RANGE_PARTITIONED.  bounds.size() == shards.size() - 1.
+        std::vector<Key> bounds;
+    };
+    typedef std::shared_ptr<const directory> directory_pointer;
+
+    directory_pointer current;
+    // Serializes the publishers of new directories (splits) and
+    // protects splitting.  A thread holding a shard's lock may take
+    // split_lock, never the other way round.
+    std::mutex split_lock;
+    // Splits under way, each of which will add a shard.
+    uint64_t splitting;
+
+    shard_pointer new_shard(void) const {
+        return shard_pointer(new shard(max_node_size, min_node_size, min_flush_size));
+    }
+
+    directory_pointer snapshot(void) const {
+        return std::atomic_load(&current);
+    }
+
+    uint64_t shard_index(const directory &d, const Key &k) const {
+        if (mode == HASH_PARTITIONED)
+            return std::hash<Key>()(k) % d.shards.size();
+        return std::upper_bound(d.bounds.begin(), d.bounds.end(), k) - d.bounds.begin();
+    }
+
+    shard_pointer route(const Key &k) const {
+        directory_pointer d = snapshot();
+        return d->shards[shard_index(*d, k)];
+    }
+
+    // Split the range shard s at betree::split_point, which is found
+    // in O(height) rather than by walking the keys.  Only s is locked
+    // while the data moves, so operations on other shards go on, and
+    // the two halves replace s in a new directory published before s
+    // is unlocked.  Does nothing if s has already been replaced by a
+    // concurrent split.
+    void split_shard(const shard_pointer &s) {
+        {
+            std::lock_guard<std::mutex> guard(split_lock);
+            if (snapshot()->shards.size() + splitting >= max_shards)
+                return;
+            splitting++;
+        }
+
+        std::lock_guard<std::mutex> sguard(s->lock);
+        Key split_key;
+        shard_pointer left;
+        shard_pointer right;
+        bool split = !s->retired && s->tree.split_point(split_key);
+        if (split) {
+            // The data itself is moved, not copied: split_at detaches
+            // the upper half and concat hands the rest to the new left
+            // shard.
+            left = new_shard();
+            right = new_shard();
+            s->tree.split_at(split_key, right->tree);
+            left->tree.concat(s->tree);
+        }
+
+        std::lock_guard<std::mutex> guard(split_lock);
+        splitting--;
+        if (!split)
+            return;
+        // s cannot have left the directory: only a split of s, which
+        // we are, replaces it.
+        std::shared_ptr<directory> d(new directory(*snapshot()));
+        auto pos = std::find(d->shards.begin(), d->shards.end(), s);
+        assert(pos != d->shards.end());
+        uint64_t idx = pos - d->shards.begin();
+        d->shards[idx] = left;
+        d->shards.insert(d->shards.begin() + idx + 1, right);
+        d->bounds.insert(d->bounds.begin() + idx, split_key);
+        s->retired = true;
+        std::atomic_store(&current, directory_pointer(d));
+    }
+
+public:
+    // Hash-partition the key space over nshards betrees.
+    sharded_betree(uint64_t nshards,
+                   uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
+                   uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
+                   uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE) :
+        mode(HASH_PARTITIONED),
+        max_node_size(maxnodesize),
+        min_node_size(minnodesize),
+        min_flush_size(minflushsize),
+        split_threshold(0),
+        max_shards(nshards),
+        splitting(0)
+    {
+        assert(nshards > 0);
+        std::shared_ptr<directory> d(new directory);
+        for (uint64_t i = 0; i < nshards; i++)
+            d->shards.push_back(new_shard());
+        current = d;
+    }
+
+    // Range-partition the key space at the given (sorted) split keys,
+    // giving split_keys.size() + 1 initial shards.  An empty vector
+    // starts with a single shard that splits as it gets hot.
+    sharded_betree(const std::vector<Key> &split_keys,
+                   uint64_t splitthreshold = DEFAULT_SHARD_SPLIT_THRESHOLD,
+                   uint64_t maxshards = DEFAULT_MAX_SHARDS,
+                   uint64_t maxnodesize = DEFAULT_MAX_NODE_SIZE,
+                   uint64_t minnodesize = DEFAULT_MAX_NODE_SIZE / 4,
+                   uint64_t minflushsize = DEFAULT_MIN_FLUSH_SIZE) :
+        mode(RANGE_PARTITIONED),
+        max_node_size(maxnodesize),
+        min_node_size(minnodesize),
+        min_flush_size(minflushsize),
+        split_threshold(splitthreshold),
+        max_shards(maxshards),
+        splitting(0)
+    {
+        assert(std::is_sorted(split_keys.begin(), split_keys.end()));
+        std::shared_ptr<directory> d(new directory);
+        d->bounds = split_keys;
+        for (uint64_t i = 0; i <= split_keys.size(); i++)
+            d->shards.push_back(new_shard());
+        current = d;
+    }
+
+    void upsert(int opcode, Key k, Value v) {
+        shard_pointer s;
+        bool hot = false;
+        do {
+            s = route(k);
+            std::lock_guard<std::mutex> guard(s->lock);
+            if (s->retired)
+                continue;
+            s->tree.upsert(opcode, k, v);
+            s->upserts++;
+            // Counting starts over whether or not the split happens,
+            // so a shard that cannot split asks again only after
+            // another split_threshold upserts.
+            hot = mode == RANGE_PARTITIONED && s->upserts > split_threshold;
+            if (hot)
+                s->upserts = 0;
+            break;
+        } while (1);
+
+        if (hot)
+            split_shard(s);
+    }
+
+    void insert(Key k, Value v) {
+        upsert(INSERT, k, v);
+    }
+
+    void update(Key k, Value v) {
+        upsert(UPDATE, k, v);
+    }
+
+    void erase(Key k) {
+        upsert(DELETE, k, Value());
+    }
+
+    Value query(Key k) {
+        do {
+            shard_pointer s = route(k);
+            std::lock_guard<std::mutex> guard(s->lock);
+            if (!s->retired)
+                return s->tree.query(k);
+        } while (1);
+    }
+
+    // Call f(const Value &) on k's value in place, under the shard's
+    // lock; the reference is only valid during the call.  Returns false
+    // if k does not exist.
+    template<class F>
+    bool visit(const Key &k, F f) {
+        do {
+            shard_pointer s = route(k);
+            std::lock_guard<std::mutex> guard(s->lock);
+            if (!s->retired)
+                return s->tree.visit(k, f);
+        } while (1);
+    }
+
+    // Batched lookup: keys are grouped by shard and each shard answers
+    // its group with a single betree::multi_get.
+    std::vector<std::pair<Key, Value> > multi_get(std::vector<Key> keys) {
+        std::vector<std::pair<Key, Value> > result;
+        while (!keys.empty()) {
+            std::map<shard_pointer, std::vector<Key> > groups;
+            directory_pointer d = snapshot();
+            for (auto it = keys.begin(); it != keys.end(); ++it)
+                groups[d->shards[shard_index(*d, *it)]].push_back(*it);
+            // Keys whose shard was split before we got to it go around again.
+            keys.clear();
+            for (auto git = groups.begin(); git != groups.end(); ++git) {
+                std::lock_guard<std::mutex> guard(git->first->lock);
+                if (git->first->retired) {
+                    keys.insert(keys.end(), git->second.begin(), git->second.end());
+                    continue;
+                }
+                auto found = git->first->tree.multi_get(git->second);
+                result.insert(result.end(), found.begin(), found.end());
+            }
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                      return a.first < b.first;
+                  });
+        result.erase(std::unique(result.begin(), result.end(),
+                                 [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                                     return a.first == b.first;
+                                 }),
+                     result.end());
+        return result;
+    }
+
+    // Positional batched lookup, see betree::query_batch.  Each shard
+    // gets the keys routed to it as one interleaved batch.
+    void query_batch(const std::vector<Key> &keys,
+                     std::vector<Value> &values,
+                     std::vector<bool> &found) {
+        values.assign(keys.size(), Value());
+        found.assign(keys.size(), false);
+        std::vector<uint64_t> todo;
+        for (uint64_t i = 0; i < keys.size(); i++)
+            todo.push_back(i);
+        while (!todo.empty()) {
+            std::map<shard_pointer, std::vector<uint64_t> > groups;
+            directory_pointer d = snapshot();
+            for (auto it = todo.begin(); it != todo.end(); ++it)
+                groups[d->shards[shard_index(*d, keys[*it])]].push_back(*it);
+            todo.clear();
+            for (auto git = groups.begin(); git != groups.end(); ++git) {
+                const std::vector<uint64_t> &pos = git->second;
+                std::lock_guard<std::mutex> guard(git->first->lock);
+                if (git->first->retired) {
+                    todo.insert(todo.end(), pos.begin(), pos.end());
+                    continue;
+                }
+                std::vector<Key> group_keys;
+                for (auto it = pos.begin(); it != pos.end(); ++it)
+                    group_keys.push_back(keys[*it]);
+                std::vector<Value> group_values;
+                std::vector<bool> group_found;
+                git->first->tree.query_batch(group_keys, group_values, group_found);
+                for (uint64_t i = 0; i < pos.size(); i++) {
+                    values[pos[i]] = group_values[i];
+                    found[pos[i]] = group_found[i];
+                }
+            }
+        }
+    }
+
+    uint64_t num_shards(void) const {
+        return snapshot()->shards.size();
+    }
+
+    class iterator {
+        typedef std::function<typename tree_type::iterator(const tree_type &)> opener;
+
+        // Keep the shards alive even if they are split away under us.
+        std::vector<shard_pointer> owners;
+        std::vector<typename tree_type::iterator> cursors;
+        std::vector<typename tree_type::iterator> ends;
+        bool ordered;
+        bool forward;
+        uint64_t current;
+
+        // Point current at the cursor holding the next key (smallest
+        // going forward, largest going backward).  Range shards are
+        // disjoint and were opened in scan order, so the first live
+        // cursor is the next one; hash shards need a full k-way scan.
+        void select(void) {
+            if (ordered) {
+                while (current < cursors.size() && cursors[current] == ends[current])
+                    current++;
+            } else {
+                current = cursors.size();
+                for (uint64_t i = 0; i < cursors.size(); i++) {
+                    if (cursors[i] == ends[i])
+                        continue;
+                    if (current == cursors.size() ||
+                        (forward ? cursors[i].first < cursors[current].first
+                                 : cursors[current].first < cursors[i].first))
+                        current = i;
+                }
+            }
+            if (current < cursors.size()) {
+                first = cursors[current].first;
+                second = cursors[current].second;
+            }
+        }
+
+    public:
+        Key first;
+        Value second;
+
+        iterator(void)
+          : ordered(true),
+            forward(true),
+            current(0),
+            first(),
+            second()
+        {}
+
+        // Open a cursor on every shard that may hold keys for this
+        // scan.  For range shards, scanning starts at the shard owning
+        // *start (all shards if start is NULL) and moves in the
+        // direction of the scan.
+        iterator(const sharded_betree &sbet, bool forward, const Key *start, opener open)
+          : ordered(sbet.mode == RANGE_PARTITIONED),
+            forward(forward),
+            current(0),
+            first(),
+            second()
+        {
+            directory_pointer d = sbet.snapshot();
+            uint64_t nshards = d->shards.size();
+            uint64_t from = forward ? 0 : nshards - 1;
+            if (ordered && start)
+                from = sbet.shard_index(*d, *start);
+            for (uint64_t n = 0; n < nshards; n++) {
+                uint64_t i = forward ? from + n : from - n;
+                if (i >= nshards)
+                    break;
+                const tree_type &t = d->shards[i]->tree;
+                owners.push_back(d->shards[i]);
+                cursors.push_back(open(t));
+                ends.push_back(t.end());
+            }
+            select();
+        }
+
+        bool at_end(void) const {
+            return current >= cursors.size();
+        }
+
+        bool operator==(const iterator &other) const {
+            if (at_end() || other.at_end())
+                return at_end() == other.at_end();
+            return first == other.first && second == other.second;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return !operator==(other);
+        }
+
+        iterator &operator++(void) {
+            ++cursors[current];
+            select();
+            return *this;
+        }
+    };
+
+    iterator begin(void) const {
+        return iterator(*this, true, NULL,
+                        [](const tree_type &t) { return t.begin(); });
+    }
+
+    iterator lower_bound(Key key) const {
+        return iterator(*this, true, &key,
+                        [key](const tree_type &t) { return t.lower_bound(key); });
+    }
+
+    // Keys in [lo, hi), ascending.
+    iterator range(Key lo, Key hi) const {
+        return iterator(*this, true, &lo,
+                        [lo, hi](const tree_type &t) { return t.range(lo, hi); });
+    }
+
+    // All keys, descending.
+    iterator rbegin(void) const {
+        return iterator(*this, false, NULL,
+                        [](const tree_type &t) { return t.rbegin(); });
+    }
+
+    // Keys <= key, descending.
+    iterator reverse_lower_bound(Key key) const {
+        return iterator(*this, false, &key,
+                        [key](const tree_type &t) { return t.reverse_lower_bound(key); });
+    }
+
+    // Keys in [lo, hi), descending.
+    iterator reverse_range(Key lo, Key hi) const {
+        return iterator(*this, false, &hi,
+                        [lo, hi](const tree_type &t) { return t.reverse_range(lo, hi); });
+    }
+
+    iterator end(void) const {
+        return iterator();
+    }
+};
+
+#endif // SHARDED_BETREE_HPP
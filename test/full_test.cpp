@@ -10,7 +10,11 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <thread>
 #include "../src/betree.hpp"
+#include "../src/sharded_betree.hpp"
 
 void timer_start(uint64_t &timer)
 {
@@ -26,10 +30,10 @@ void timer_stop(uint64_t &timer)
     timer += 1000000 * t.tv_sec + t.tv_usec;
 }
 
-template <class Key, class Value>
-void do_scan(typename betree<Key, Value>::iterator &betit,
+template <class Tree, class Key, class Value>
+void do_scan(typename Tree::iterator &betit,
              typename std::map<Key, Value>::iterator &refit,
-             betree<Key, Value> &b,
+             Tree &b,
              typename std::map<Key, Value> &reference)
 {
     bool flag_op ;
@@ -52,11 +56,256 @@ void do_scan(typename betree<Key, Value>::iterator &betit,
     assert(betit == b.end());
 }
 
+// Check count, rank, select and aggregate against the reference.  The
+// aggregate used by the tests is the total length of the values.
+template <class Key, class Value>
+void check_summaries(betree<Key, Value> &b,
+                     typename std::map<Key, Value> &reference,
+                     Key lo, Key hi)
+{
+    if (!b.is_augmented())
+        return;
+    assert(b.size() == reference.size());
+    uint64_t count = 0;
+    double sum = 0;
+    for (auto it = reference.lower_bound(lo); it != reference.lower_bound(hi); ++it)
+    {
+        count++;
+        sum += it->second.size();
+    }
+    assert(b.count(lo, hi) == count);
+    assert(b.aggregate(lo, hi) == sum);
+    assert(b.rank(lo) == (uint64_t)std::distance(reference.begin(), reference.lower_bound(lo)));
+    if (!reference.empty())
+    {
+        uint64_t i = rand() % reference.size();
+        auto refit = reference.begin();
+        std::advance(refit, i);
+        auto p = b.select(i);
+        assert(p.first == refit->first);
+        assert(p.second == refit->second);
+    }
+}
+
+// A byte budget smaller than a few pivots must not make internal
+// nodes split into single-child nodes, which added a level per insert
+// until the recursion overflowed the stack.
+void check_tiny_byte_budget(uint64_t max_node_size, uint64_t min_flush_size)
+{
+    betree<uint64_t, std::string> b(max_node_size, max_node_size / 4, min_flush_size);
+    b.set_max_node_bytes(1);
+    for (uint64_t i = 0; i < 20000; i++)
+        b.insert((i * 7919) % 20000, std::to_string(i) + ":");
+    for (uint64_t i = 0; i < 20000; i++)
+        assert(b.query((i * 7919) % 20000) == std::to_string(i) + ":");
+}
+
+// An unpinned buffer follows max_node_size both ways; a pinned one
+// survives node size changes and leaving adaptive mode.
+void check_buffer_size_knobs(uint64_t max_node_size)
+{
+    betree<uint64_t, std::string> b(max_node_size);
+    b.set_max_node_size(2 * max_node_size);
+    assert(b.get_max_buffer_size() == 2 * max_node_size);
+    b.set_max_buffer_size(max_node_size);
+    b.set_max_node_size(max_node_size / 2 + 1);
+    assert(b.get_max_buffer_size() == max_node_size / 2 + 1);
+    b.set_max_node_size(4 * max_node_size);
+    assert(b.get_max_buffer_size() == max_node_size);
+    b.set_adaptive(true);
+    b.set_adaptive(false);
+    assert(b.get_max_buffer_size() == max_node_size);
+}
+
+// Erase or rewrite every key in [lo, hi) as the iterator reaches it,
+// before stepping on: the iterator must not depend on the nodes the
+// writes replace.
+template <class Key, class Value>
+void modify_while_scanning(betree<Key, Value> &b,
+                           typename std::map<Key, Value> &reference,
+                           Key lo, Key hi)
+{
+    auto refit = reference.lower_bound(lo);
+    for (auto betit = b.range(lo, hi); betit != b.end(); ++betit)
+    {
+        assert(refit != reference.end());
+        assert(betit.first == refit->first);
+        assert(betit.second == refit->second);
+        if (rand() % 2)
+        {
+            b.erase(betit.first);
+            refit = reference.erase(refit);
+        }
+        else
+        {
+            b.insert(betit.first, std::to_string(betit.first) + ":");
+            refit->second = std::to_string(betit.first) + ":";
+            ++refit;
+        }
+    }
+    assert(refit == reference.lower_bound(hi));
+}
+
+// sharded_betree iterators must not be used while writers are running.
+template <class Key, class Value>
+void modify_while_scanning(sharded_betree<Key, Value> &b,
+                           typename std::map<Key, Value> &reference,
+                           Key lo, Key hi)
+{
+}
+
+// Writing a value larger than a whole node must not grow the tree: a
+// leaf holding just that value cannot be split any further, so it must
+// stay a single leaf, the same as in a tree without a byte budget.
+void check_oversized_values(uint64_t max_node_size, uint64_t min_flush_size, uint64_t max_node_bytes)
+{
+    betree<uint64_t, std::string> b(max_node_size, max_node_size / 4, min_flush_size);
+    betree<uint64_t, std::string> unlimited(max_node_size, max_node_size / 4, min_flush_size);
+    b.set_max_node_bytes(max_node_bytes);
+    std::string big(2 * max_node_bytes, '#');
+    unlimited.insert(0, big);
+    for (int i = 0; i < 256; i++)
+    {
+        b.update(0, big);
+        assert(b.memory_usage() == unlimited.memory_usage());
+    }
+    assert(b.query(0) == big);
+}
+
+// sharded_betree has no subtree summaries.
+template <class Key, class Value>
+void check_summaries(sharded_betree<Key, Value> &b,
+                     typename std::map<Key, Value> &reference,
+                     Key lo, Key hi)
+{
+}
+
+// Walk [lo, hi) with the zero-copy scan and check it against the
+// reference.
+template <class Key, class Value>
+void check_scan(betree<Key, Value> &b,
+                typename std::map<Key, Value> &reference,
+                Key lo, Key hi)
+{
+    auto refit = reference.lower_bound(lo);
+    auto refend = reference.lower_bound(hi);
+    uint64_t n = b.scan(lo, hi, [&](const Key &k, const Value &v) {
+        assert(refit != refend);
+        assert(k == refit->first);
+        assert(v == refit->second);
+        ++refit;
+    });
+    assert(refit == refend);
+    assert(n == (uint64_t)std::distance(reference.lower_bound(lo), refend));
+}
+
+// sharded_betree has no scan.
+template <class Key, class Value>
+void check_scan(sharded_betree<Key, Value> &b,
+                typename std::map<Key, Value> &reference,
+                Key lo, Key hi)
+{
+}
+
+// Split b at k, check both halves against the reference, and
+// concatenate them again.
+template <class Key, class Value>
+void split_and_concat(betree<Key, Value> &b,
+                      typename std::map<Key, Value> &reference,
+                      Key k)
+{
+    betree<Key, Value> right;
+    b.split_at(k, right);
+    auto betit = right.begin();
+    auto refit = reference.lower_bound(k);
+    for (; refit != reference.end(); ++refit, ++betit)
+    {
+        assert(betit != right.end());
+        assert(betit.first == refit->first);
+        assert(betit.second == refit->second);
+    }
+    assert(betit == right.end());
+    auto leftit = b.begin();
+    for (refit = reference.begin(); refit != reference.lower_bound(k); ++refit, ++leftit)
+    {
+        assert(leftit != b.end());
+        assert(leftit.first == refit->first);
+        assert(leftit.second == refit->second);
+    }
+    assert(leftit == b.end());
+    if (b.is_augmented())
+        assert(b.size() + right.size() == reference.size());
+    b.concat(right);
+    assert(right.begin() == right.end());
+}
+
+// sharded_betree has no subtree split/merge.
+template <class Key, class Value>
+void split_and_concat(sharded_betree<Key, Value> &b,
+                      typename std::map<Key, Value> &reference,
+                      Key k)
+{
+}
+
+// Checkpoint into dir and restore from it.  A second checkpoint right
+// after the restore must find nothing dirty.
+template <class Key, class Value>
+void checkpoint_and_restore(betree<Key, Value> &b, const char *dir)
+{
+    b.checkpoint(dir);
+    b.restore(dir);
+    assert(b.checkpoint(dir) == 0);
+}
+
+// A new tree checkpointing into dir over an older tree's checkpoint
+// must take over the directory: nothing of the older checkpoint may be
+// left behind or restored.
+void check_checkpoint_takeover(const char *dir, uint64_t max_node_size, uint64_t min_flush_size)
+{
+    betree<uint64_t, std::string> older(max_node_size, max_node_size / 4, min_flush_size);
+    betree<uint64_t, std::string> newer(max_node_size, max_node_size / 4, min_flush_size);
+    betree<uint64_t, std::string> restored(max_node_size, max_node_size / 4, min_flush_size);
+    for (uint64_t i = 0; i < 16 * max_node_size; i++)
+        older.insert(i, "older");
+    for (uint64_t i = 0; i < 4 * max_node_size; i++)
+        newer.insert(2 * i, "newer");
+    older.checkpoint(dir);
+    uint64_t written = newer.checkpoint(dir);
+
+    uint64_t files = 0;
+    DIR *dp = opendir(dir);
+    assert(dp);
+    for (struct dirent *e = readdir(dp); e; e = readdir(dp))
+        files += strncmp(e->d_name, "node.", 5) == 0;
+    closedir(dp);
+    assert(files == written);
+
+    restored.restore(dir);
+    auto refit = newer.begin();
+    auto betit = restored.begin();
+    for (; refit != newer.end(); ++refit, ++betit)
+    {
+        assert(betit != restored.end());
+        assert(betit.first == refit.first);
+        assert(betit.second == refit.second);
+    }
+    assert(betit == restored.end());
+}
+
+// sharded_betree has no checkpoints.
+template <class Key, class Value>
+void checkpoint_and_restore(sharded_betree<Key, Value> &b, const char *dir)
+{
+}
+
 #define DEFAULT_TEST_MAX_NODE_SIZE (1ULL << 6)
 #define DEFAULT_TEST_MIN_FLUSH_SIZE (DEFAULT_TEST_MAX_NODE_SIZE / 4)
 #define DEFAULT_TEST_CACHE_SIZE (4)
 #define DEFAULT_TEST_NDISTINCT_KEYS (1ULL << 10)
 #define DEFAULT_TEST_NOPS (1ULL << 12)
+#define DEFAULT_TEST_BATCH_SIZE (256)
+#define DEFAULT_TEST_CHECKPOINT_INTERVAL (512)
+#define DEFAULT_TEST_NTHREADS (4)
 
 void usage(char *name)
 {
@@ -66,33 +315,51 @@ void usage(char *name)
         << std::endl
         << "Options are" << std::endl
         << "  Required:" << std::endl
-        << "    -m  <mode>  (test or benchmark-<mode>)          [ default: none, parameter required ]" << std::endl
+        << "    -m  <mode>  (test, test-sharded or benchmark-<mode>) [ default: none, parameter required ]" << std::endl
         << "        benchmark modes:" << std::endl
         << "          upserts    " << std::endl
         << "          queries    " << std::endl
+        << "          multigets  " << std::endl
+        << "          appends    " << std::endl
         << "  Betree tuning parameters:" << std::endl
         << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE << " ]" << std::endl
         << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
         << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE << " ]" << std::endl
+        << "    -B <max_node_bytes>           (in bytes)        [ default: 0, unlimited ]" << std::endl
+        << "    -L <lookup_cache_bytes>       (in bytes)        [ default: 0, no cache ]" << std::endl
+        << "    -S                            (augmented mode: counts and sums) [ default: off ]" << std::endl
+        << "    -A <adapt_interval>           (in operations)   [ default: 0, adaptive mode off ]" << std::endl
+        << "    -Z <cold_age>                 (in upserts)      [ default: 0, cold leaves not packed ]" << std::endl
+        << "  Options for tests" << std::endl
+        << "    -d <checkpoint_dir>           (existing directory) [ default: none, no checkpoints ]" << std::endl
         << "  Options for both tests and benchmarks" << std::endl
         << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
         << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS << " ]" << std::endl
         << "    -s <random_seed>                                [ default: random ]" << std::endl
+        << "    -P                            (print perf_event_open counters per op) [ default: off ]" << std::endl
         << std::endl;
 }
 
-int test(betree<uint64_t, std::string> &b,
+template <class Tree>
+int test(Tree &b,
          uint64_t nops,
-         uint64_t number_of_distinct_keys)
+         uint64_t number_of_distinct_keys,
+         const char *checkpoint_dir = NULL,
+         uint64_t max_node_bytes = 0)
 {
     std::map<uint64_t, std::string> reference;
+    // Keys past number_of_distinct_keys, handed out in increasing order.
+    uint64_t next_append_key = number_of_distinct_keys;
 
     for (unsigned int i = 0; i < nops; i++)
     {
         int op;
         uint64_t t;
 
-        op = rand() % 6;
+        if (checkpoint_dir && i % DEFAULT_TEST_CHECKPOINT_INTERVAL == DEFAULT_TEST_CHECKPOINT_INTERVAL - 1)
+            checkpoint_and_restore(b, checkpoint_dir);
+
+        op = rand() % 15;
         t = rand() % number_of_distinct_keys;
 
         switch (op)
@@ -125,6 +392,9 @@ int test(betree<uint64_t, std::string> &b,
             {
                 assert(reference.count(t) == 0);
             }
+            assert(b.visit(t, [&](const std::string &v) {
+                assert(v == reference[t]);
+            }) == (reference.count(t) > 0));
             break;
         case 4: // full scan
         {
@@ -140,6 +410,99 @@ int test(betree<uint64_t, std::string> &b,
             do_scan(betit, refit, b, reference);
         }
         break;
+        case 6: // multi-get
+        {
+            std::vector<uint64_t> keys;
+            for (int j = 0; j < 16; j++)
+                keys.push_back((t + rand() % 64) % number_of_distinct_keys);
+            auto results = b.multi_get(keys);
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            auto rit = results.begin();
+            for (auto kit = keys.begin(); kit != keys.end(); ++kit)
+            {
+                if (reference.count(*kit) == 0)
+                    continue;
+                assert(rit != results.end());
+                assert(rit->first == *kit);
+                assert(rit->second == reference[*kit]);
+                ++rit;
+            }
+            assert(rit == results.end());
+        }
+        break;
+        case 9: // bounded range scan
+        {
+            uint64_t hi = t + rand() % 64;
+            auto betit = b.range(t, hi);
+            auto refit = reference.lower_bound(t);
+            auto refend = reference.lower_bound(hi);
+            for (; refit != refend; ++refit, ++betit)
+            {
+                assert(betit != b.end());
+                assert(betit.first == refit->first);
+                assert(betit.second == refit->second);
+            }
+            assert(betit == b.end());
+            check_scan(b, reference, t, hi);
+        }
+        break;
+        case 10: // reverse scans
+        {
+            bool bounded = rand() % 2;
+            uint64_t lo = t < 64 ? 0 : t - rand() % 64;
+            auto betit = bounded ? b.reverse_range(lo, t) : b.rbegin();
+            std::map<uint64_t, std::string>::reverse_iterator refit(bounded ? reference.lower_bound(t) : reference.end());
+            std::map<uint64_t, std::string>::reverse_iterator refend(bounded ? reference.lower_bound(lo) : reference.begin());
+            for (; refit != refend; ++refit, ++betit)
+            {
+                assert(betit != b.end());
+                assert(betit.first == refit->first);
+                assert(betit.second == refit->second);
+            }
+            assert(betit == b.end());
+        }
+        break;
+        case 11: // subtree summaries
+            check_summaries(b, reference, t, t + rand() % 256);
+            break;
+        case 12: // subtree split and concatenation
+            split_and_concat(b, reference, t);
+            break;
+        case 14: // writes during a scan
+            modify_while_scanning(b, reference, t, t + rand() % 64);
+            break;
+        case 13: // values larger than a whole node
+            if (!max_node_bytes)
+                break;
+            b.insert(t, std::to_string(t) + ":" + std::string(2 * max_node_bytes, '#'));
+            reference[t] = std::to_string(t) + ":" + std::string(2 * max_node_bytes, '#');
+            break;
+        case 8: // occasional burst of ever-larger keys
+            if (rand() % 8 != 0)
+                break;
+            for (int j = 0; j < 2 * APPEND_RUN_THRESHOLD; j++)
+            {
+                uint64_t k = next_append_key++;
+                b.insert(k, std::to_string(k) + ":");
+                reference[k] = std::to_string(k) + ":";
+            }
+            break;
+        case 7: // interleaved batch query
+        {
+            std::vector<uint64_t> keys;
+            for (int j = 0; j < 16; j++)
+                keys.push_back(rand() % number_of_distinct_keys);
+            std::vector<std::string> values;
+            std::vector<bool> found;
+            b.query_batch(keys, values, found);
+            for (uint64_t j = 0; j < keys.size(); j++)
+            {
+                assert(found[j] == (reference.count(keys[j]) > 0));
+                assert(!found[j] || values[j] == reference[keys[j]]);
+            }
+        }
+        break;
         default:
             abort();
         }
@@ -150,6 +513,80 @@ int test(betree<uint64_t, std::string> &b,
     return 0;
 }
 
+// Upserts, queries and multi-gets from nthreads threads at once, while
+// range shards split under them.  Thread i only writes the keys that
+// are i mod nthreads, so it can check its own reads against a private
+// reference map; at the end the tree is checked against all of them.
+void test_sharded_threads(uint64_t nthreads,
+                          uint64_t nops,
+                          uint64_t number_of_distinct_keys,
+                          uint64_t max_node_size,
+                          uint64_t min_flush_size)
+{
+    sharded_betree<uint64_t, std::string> b(std::vector<uint64_t>(), nops / 64, DEFAULT_MAX_SHARDS,
+                                            max_node_size, max_node_size / 4, min_flush_size);
+    std::vector<std::map<uint64_t, std::string> > references(nthreads);
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < nthreads; i++)
+        threads.push_back(std::thread([&, i]() {
+            std::map<uint64_t, std::string> &reference = references[i];
+            unsigned int seed = i;
+            for (uint64_t j = 0; j < nops; j++)
+            {
+                uint64_t t = rand_r(&seed) % (number_of_distinct_keys / nthreads) * nthreads + i;
+                switch (rand_r(&seed) % 4)
+                {
+                case 0: // insert
+                    b.insert(t, std::to_string(t) + ":" + std::to_string(j));
+                    reference[t] = std::to_string(t) + ":" + std::to_string(j);
+                    break;
+                case 1: // delete
+                    b.erase(t);
+                    reference.erase(t);
+                    break;
+                case 2: // query
+                    assert(b.visit(t, [&](const std::string &v) {
+                        assert(v == reference[t]);
+                    }) == (reference.count(t) > 0));
+                    break;
+                case 3: // multi-get
+                {
+                    std::vector<uint64_t> keys;
+                    for (int k = 0; k < 16; k++)
+                        keys.push_back((t + k * nthreads) % (number_of_distinct_keys / nthreads * nthreads));
+                    std::sort(keys.begin(), keys.end());
+                    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+                    auto results = b.multi_get(keys);
+                    uint64_t present = 0;
+                    for (auto kit = keys.begin(); kit != keys.end(); ++kit)
+                        present += reference.count(*kit);
+                    assert(results.size() == present);
+                    for (auto rit = results.begin(); rit != results.end(); ++rit)
+                        assert(rit->second == reference[rit->first]);
+                }
+                break;
+                }
+            }
+        }));
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    std::map<uint64_t, std::string> reference;
+    for (auto it = references.begin(); it != references.end(); ++it)
+        reference.insert(it->begin(), it->end());
+    auto betit = b.begin();
+    for (auto refit = reference.begin(); refit != reference.end(); ++refit, ++betit)
+    {
+        assert(betit != b.end());
+        assert(betit.first == refit->first);
+        assert(betit.second == refit->second);
+    }
+    assert(betit == b.end());
+    assert(b.num_shards() > 1);
+
+    std::cout << "Test PASSED" << std::endl;
+}
+
 void benchmark_upserts(betree<uint64_t, std::string> &b,
                        uint64_t nops,
                        uint64_t number_of_distinct_keys,
@@ -197,6 +634,51 @@ void benchmark_queries(betree<uint64_t, std::string> &b,
     }
     timer_stop(overall_timer);
     printf("# overall: %ld %ld\n", nops, overall_timer);
+    if (b.get_cache_hits() + b.get_cache_misses())
+        printf("# cache: %ld %ld\n", b.get_cache_hits(), b.get_cache_misses());
+}
+
+void benchmark_appends(betree<uint64_t, std::string> &b,
+                       uint64_t nops)
+{
+    uint64_t overall_timer = 0;
+    timer_start(overall_timer);
+    for (uint64_t i = 0; i < nops; i++)
+        b.insert(i, "value");
+    timer_stop(overall_timer);
+    printf("# overall: %ld %ld %ld\n", nops, overall_timer, b.memory_usage());
+}
+
+void benchmark_multigets(betree<uint64_t, std::string> &b,
+                         uint64_t nops,
+                         uint64_t number_of_distinct_keys,
+                         uint64_t random_seed)
+{
+
+    // Pre-load the tree with data
+    srand(random_seed);
+    for (uint64_t i = 0; i < nops; i++)
+    {
+        uint64_t t = rand() % number_of_distinct_keys;
+        b.update(t, std::to_string(t) + ":");
+    }
+
+    // Now go back and query it in batches of DEFAULT_TEST_BATCH_SIZE
+    srand(random_seed);
+    std::vector<uint64_t> keys;
+    uint64_t overall_timer = 0;
+    timer_start(overall_timer);
+    for (uint64_t i = 0; i < nops; i++)
+    {
+        keys.push_back(rand() % number_of_distinct_keys);
+        if (keys.size() == DEFAULT_TEST_BATCH_SIZE || i == nops - 1)
+        {
+            b.multi_get(keys);
+            keys.clear();
+        }
+    }
+    timer_stop(overall_timer);
+    printf("# overall: %ld %ld\n", nops, overall_timer);
 }
 
 int main(int argc, char **argv)
@@ -205,9 +687,15 @@ int main(int argc, char **argv)
     uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
     uint64_t min_flush_size = DEFAULT_TEST_MIN_FLUSH_SIZE;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
-    char *backing_store_dir = NULL;
+    char *checkpoint_dir = NULL;
     uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
     uint64_t nops = DEFAULT_TEST_NOPS;
+    uint64_t adapt_interval = 0;
+    uint64_t cold_age = 0;
+    uint64_t max_node_bytes = 0;
+    uint64_t lookup_cache_bytes = 0;
+    bool augmented = false;
+    bool profile = false;
     unsigned int random_seed = time(NULL) * getpid();
 
     int opt;
@@ -217,7 +705,7 @@ int main(int argc, char **argv)
     // Argument parsing //
     //////////////////////
 
-    while ((opt = getopt(argc, argv, "m:N:f:C:k:t:s:")) != -1)
+    while ((opt = getopt(argc, argv, "m:N:f:C:B:L:SA:Z:d:k:t:s:P")) != -1)
     {
         switch (opt)
         {
@@ -251,6 +739,51 @@ int main(int argc, char **argv)
                 exit(1);
             }
             break;
+        case 'B':
+            max_node_bytes = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -B must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'L':
+            lookup_cache_bytes = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -L must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'S':
+            augmented = true;
+            break;
+        case 'A':
+            adapt_interval = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -A must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'Z':
+            cold_age = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -Z must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'd':
+            checkpoint_dir = optarg;
+            break;
+        case 'P':
+            profile = true;
+            break;
         case 'k':
             number_of_distinct_keys = strtoull(optarg, &term, 10);
             if (*term)
@@ -286,7 +819,9 @@ int main(int argc, char **argv)
     }
 
     if (mode == NULL ||
-        (strcmp(mode, "test") != 0 && strcmp(mode, "benchmark-upserts") != 0 && strcmp(mode, "benchmark-queries") != 0))
+        (strcmp(mode, "test") != 0 && strcmp(mode, "test-sharded") != 0 && strcmp(mode, "benchmark-upserts") != 0 && strcmp(mode, "benchmark-queries") != 0 &&
+         strcmp(mode, "benchmark-multigets") != 0 &&
+         strcmp(mode, "benchmark-appends") != 0))
     {
         std::cerr << "Must specify a mode of \"test\" or \"benchmark\"" << std::endl;
         usage(argv[0]);
@@ -301,12 +836,57 @@ int main(int argc, char **argv)
 
   
     betree<uint64_t, std::string> b(max_node_size, max_node_size/4,min_flush_size);
+    b.set_max_node_bytes(max_node_bytes);
+    b.set_cache_size(lookup_cache_bytes);
+    if (augmented)
+        b.set_augmented([](const uint64_t &, const std::string &v) { return (double)v.size(); });
+    if (adapt_interval)
+        b.set_adaptive(true, adapt_interval);
+    b.set_cold_compression(cold_age);
+    if (profile)
+    {
+        try
+        {
+            b.set_profiling(true);
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << e.what() << std::endl;
+            exit(1);
+        }
+    }
 
+    if (strcmp(mode, "test") == 0 && checkpoint_dir)
+        check_checkpoint_takeover(checkpoint_dir, max_node_size, min_flush_size);
+    if (strcmp(mode, "test") == 0)
+        check_tiny_byte_budget(max_node_size, min_flush_size);
+    if (strcmp(mode, "test") == 0)
+        check_buffer_size_knobs(max_node_size);
+    if (strcmp(mode, "test") == 0 && max_node_bytes)
+        check_oversized_values(max_node_size, min_flush_size, max_node_bytes);
     if (strcmp(mode, "test") == 0)
-        test(b, nops, number_of_distinct_keys);
+        test(b, nops, number_of_distinct_keys, checkpoint_dir, max_node_bytes);
+    else if (strcmp(mode, "test-sharded") == 0)
+    {
+        // Small split threshold so that range shards split during the test.
+        sharded_betree<uint64_t, std::string> rb(std::vector<uint64_t>(), nops / 16, DEFAULT_MAX_SHARDS,
+                                                 max_node_size, max_node_size / 4, min_flush_size);
+        test(rb, nops, number_of_distinct_keys);
+        sharded_betree<uint64_t, std::string> hb(4, max_node_size, max_node_size / 4, min_flush_size);
+        test(hb, nops, number_of_distinct_keys);
+        test_sharded_threads(DEFAULT_TEST_NTHREADS, nops, number_of_distinct_keys, max_node_size, min_flush_size);
+    }
     else if (strcmp(mode, "benchmark-upserts") == 0)
         benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
     else if (strcmp(mode, "benchmark-queries") == 0)
         benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
+    else if (strcmp(mode, "benchmark-multigets") == 0)
+        benchmark_multigets(b, nops, number_of_distinct_keys, random_seed);
+    else if (strcmp(mode, "benchmark-appends") == 0)
+        benchmark_appends(b, nops);
+    if (cold_age)
+        printf("# packed: %ld %ld\n", b.get_packed_leaves(), b.memory_usage());
+    if (profile)
+        b.get_profile().print(std::cout);
     return 0;
 }
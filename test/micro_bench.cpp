@@ -0,0 +1,544 @@
+// Micro-benchmarks for the node-level operations of a betree: applying
+// messages to a leaf or an internal buffer, splitting, merging,
+// flushing a full buffer, pivot search, leaf lookups and iterator
+// steps.  Every case runs over a sweep of node sizes, key
+// distributions and value sizes.  Keys, values and messages are built
+// before the clock starts, warmup runs are discarded, and the timed
+// repetitions are reported as min/median/mean/stddev/max nanoseconds
+// per operation.
+
+// Nodes are private to betree; betree_node_bench is declared a friend
+// there so that they can be driven directly.
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cmath>
+#include <random>
+#include "../src/betree.hpp"
+
+#define DEFAULT_BENCH_WARMUP (2)
+#define DEFAULT_BENCH_REPS (10)
+#define DEFAULT_BENCH_NODE_SIZES "64,256,1024,4096"
+#define DEFAULT_BENCH_VALUE_SIZES "8,256"
+// Children of the internal nodes built by the merge and flush cases.
+#define BENCH_FANOUT (16)
+// The iteration cases scan a whole tree of this many nodes' worth of keys.
+#define BENCH_TREE_NODES (8)
+
+typedef betree<uint64_t, std::string> bench_tree;
+
+// Results are folded into this so that the timed loops are not
+// optimized away.
+volatile uint64_t bench_sink;
+
+uint64_t now_ns(void)
+{
+    struct timespec t;
+    int r = clock_gettime(CLOCK_MONOTONIC, &t);
+    assert(!r);
+    (void)r;
+    return 1000000000ULL * t.tv_sec + t.tv_nsec;
+}
+
+// With -P, the counters are also read around every timed section and
+// section_counts holds the difference for the last one.
+perf_counters bench_counters;
+bool bench_profiling;
+uint64_t section_start_counts[PERF_NUM_COUNTERS];
+uint64_t section_counts[PERF_NUM_COUNTERS];
+
+uint64_t start_section(void)
+{
+    if (bench_profiling)
+        bench_counters.read(section_start_counts);
+    return now_ns();
+}
+
+uint64_t stop_section(uint64_t start)
+{
+    uint64_t elapsed = now_ns() - start;
+    if (bench_profiling)
+    {
+        bench_counters.read(section_counts);
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+            section_counts[c] = section_counts[c] > section_start_counts[c] ? section_counts[c] - section_start_counts[c] : 0;
+    }
+    return elapsed;
+}
+
+// One point of the sweep.  With sequential keys, nodes are filled and
+// probed in ascending key order; with random keys both happen in a
+// random order.
+struct bench_params
+{
+    uint64_t node_size;
+    bool random_keys;
+    uint64_t value_size;
+    uint64_t seed;
+};
+
+template <class Tree>
+struct betree_node_bench
+{
+    typedef typename Tree::node node;
+    typedef typename Tree::node_pointer node_pointer;
+    typedef typename Tree::child_info child_info;
+    typedef typename Tree::pivot_map pivot_map;
+    typedef Message<std::string> message;
+
+    const bench_params &p;
+    // n distinct keys in insertion order, and the same keys in probe
+    // order.
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> probes;
+    std::vector<message> messages;
+    std::mt19937_64 rng;
+
+    betree_node_bench(const bench_params &p, uint64_t n)
+        : p(p),
+          rng(p.seed)
+    {
+        if (p.random_keys)
+        {
+            std::set<uint64_t> seen;
+            while (keys.size() < n)
+            {
+                uint64_t k = rng();
+                if (seen.insert(k).second)
+                    keys.push_back(k);
+            }
+        }
+        else
+        {
+            for (uint64_t i = 0; i < n; i++)
+                keys.push_back(i);
+        }
+        probes = keys;
+        if (p.random_keys)
+            std::shuffle(probes.begin(), probes.end(), rng);
+        messages.assign(n, message(INSERT, std::string(p.value_size, 'v')));
+    }
+
+    node_pointer make_leaf(Tree &bet, uint64_t n)
+    {
+        node_pointer leaf(new node);
+        for (uint64_t i = 0; i < n; i++)
+            leaf->apply(bet, keys[i], messages[i]);
+        return leaf;
+    }
+
+    // An internal node whose children are the leaves holding
+    // keys[0, n), split evenly at fanout - 1 pivots.
+    node_pointer make_parent(Tree &bet, uint64_t n, uint64_t fanout)
+    {
+        std::vector<uint64_t> sorted(keys.begin(), keys.begin() + n);
+        std::sort(sorted.begin(), sorted.end());
+        node_pointer parent(new node);
+        for (uint64_t c = 0; c < fanout; c++)
+        {
+            node_pointer child(new node);
+            for (uint64_t i = c * n / fanout; i < (c + 1) * n / fanout; i++)
+                child->apply(bet, sorted[i], messages[i]);
+            parent->set_pivot(bet, sorted[c * n / fanout], child_info(child));
+        }
+        return parent;
+    }
+
+    // Each case returns the elapsed time of its timed section and sets
+    // ops to the number of operations it performed.
+
+    uint64_t apply_leaf(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer leaf(new node);
+        uint64_t start = start_section();
+        for (uint64_t i = 0; i < p.node_size; i++)
+            leaf->apply(bet, keys[i], messages[i]);
+        uint64_t elapsed = stop_section(start);
+        ops = p.node_size;
+        return elapsed;
+    }
+
+    uint64_t apply_internal(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        // Children are empty: only the buffer is exercised.
+        node_pointer parent(new node);
+        uint64_t lowest = *std::min_element(keys.begin(), keys.end());
+        node_pointer child(new node);
+        parent->set_pivot(bet, lowest, child_info(child));
+        uint64_t start = start_section();
+        for (uint64_t i = 0; i < p.node_size; i++)
+            parent->apply(bet, keys[i], messages[i]);
+        uint64_t elapsed = stop_section(start);
+        ops = p.node_size;
+        return elapsed;
+    }
+
+    uint64_t split(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer leaf = make_leaf(bet, p.node_size);
+        uint64_t start = start_section();
+        pivot_map halves = leaf->split(bet);
+        uint64_t elapsed = stop_section(start);
+        bench_sink += halves.size();
+        ops = 1;
+        return elapsed;
+    }
+
+    uint64_t merge(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer parent = make_parent(bet, p.node_size, BENCH_FANOUT);
+        uint64_t start = start_section();
+        node_pointer merged = parent->merge(bet, parent->pivots.begin(), parent->pivots.end());
+        uint64_t elapsed = stop_section(start);
+        bench_sink += merged->size();
+        ops = 1;
+        return elapsed;
+    }
+
+    // A node with a full buffer over empty leaves, flushed until it is
+    // no longer full.  Reported per message moved.
+    uint64_t flush(uint64_t &ops)
+    {
+        Tree bet(p.node_size, p.node_size / 4, 1);
+        std::vector<uint64_t> sorted(keys.begin(), keys.begin() + p.node_size);
+        std::sort(sorted.begin(), sorted.end());
+        node_pointer parent(new node);
+        for (uint64_t c = 0; c < BENCH_FANOUT; c++)
+        {
+            node_pointer child(new node);
+            parent->set_pivot(bet, sorted[c * p.node_size / BENCH_FANOUT], child_info(child));
+        }
+        for (uint64_t i = 0; i < p.node_size; i++)
+            parent->apply(bet, keys[i], messages[i]);
+        uint64_t before = parent->elements.size();
+        uint64_t start = start_section();
+        parent->flush_max_message_set(bet);
+        uint64_t elapsed = stop_section(start);
+        ops = std::max<uint64_t>(1, before - parent->elements.size());
+        return elapsed;
+    }
+
+    // node_size pivots over empty children, searched for every probe.
+    uint64_t get_pivot(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer parent(new node);
+        for (uint64_t i = 0; i < p.node_size; i++)
+        {
+            node_pointer child(new node);
+            parent->set_pivot(bet, keys[i], child_info(child));
+        }
+        const node &n = *parent;
+        uint64_t sum = 0;
+        uint64_t start = start_section();
+        for (uint64_t i = 0; i < p.node_size; i++)
+            sum += n.get_pivot(probes[i])->first;
+        uint64_t elapsed = stop_section(start);
+        bench_sink += sum;
+        ops = p.node_size;
+        return elapsed;
+    }
+
+    // Lookups in a single leaf, copying the value out (node::query) or
+    // handing back a pointer to it (node::query_step).
+    uint64_t leaf_query(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer leaf = make_leaf(bet, p.node_size);
+        uint64_t sum = 0;
+        uint64_t start = start_section();
+        for (uint64_t i = 0; i < p.node_size; i++)
+            sum += leaf->query(bet, probes[i]).size();
+        uint64_t elapsed = stop_section(start);
+        bench_sink += sum;
+        ops = p.node_size;
+        return elapsed;
+    }
+
+    uint64_t leaf_find(uint64_t &ops)
+    {
+        Tree bet(p.node_size);
+        node_pointer leaf = make_leaf(bet, p.node_size);
+        uint64_t sum = 0;
+        uint64_t start = start_section();
+        for (uint64_t i = 0; i < p.node_size; i++)
+        {
+            const std::string *v;
+            leaf->query_step(bet, probes[i], v);
+            sum += v->size();
+        }
+        uint64_t elapsed = stop_section(start);
+        bench_sink += sum;
+        ops = p.node_size;
+        return elapsed;
+    }
+
+    void fill_tree(Tree &bet)
+    {
+        for (uint64_t i = 0; i < keys.size(); i++)
+            bet.insert(keys[i], messages[i].val);
+    }
+
+    uint64_t iterate(uint64_t &ops)
+    {
+        Tree bet(p.node_size, p.node_size / 4, p.node_size / 16);
+        fill_tree(bet);
+        uint64_t sum = 0;
+        uint64_t start = start_section();
+        for (auto it = bet.begin(); it != bet.end(); ++it)
+            sum += it.second.size();
+        uint64_t elapsed = stop_section(start);
+        bench_sink += sum;
+        ops = keys.size();
+        return elapsed;
+    }
+
+    uint64_t scan(uint64_t &ops)
+    {
+        Tree bet(p.node_size, p.node_size / 4, p.node_size / 16);
+        fill_tree(bet);
+        uint64_t sum = 0;
+        uint64_t start = start_section();
+        bet.scan(0, ~0ULL, [&](const uint64_t &, const std::string &v) {
+            sum += v.size();
+        });
+        uint64_t elapsed = stop_section(start);
+        bench_sink += sum;
+        ops = keys.size();
+        return elapsed;
+    }
+};
+
+typedef betree_node_bench<bench_tree> bench;
+
+struct bench_case
+{
+    const char *name;
+    uint64_t (bench::*run)(uint64_t &ops);
+    // Keys needed, in nodes' worth.
+    uint64_t nodes;
+};
+
+bench_case cases[] = {
+    {"apply-leaf", &bench::apply_leaf, 1},
+    {"apply-internal", &bench::apply_internal, 1},
+    {"split", &bench::split, 1},
+    {"merge", &bench::merge, 1},
+    {"flush", &bench::flush, 1},
+    {"get-pivot", &bench::get_pivot, 1},
+    {"leaf-query", &bench::leaf_query, 1},
+    {"leaf-find", &bench::leaf_find, 1},
+    {"iterate", &bench::iterate, BENCH_TREE_NODES},
+    {"scan", &bench::scan, BENCH_TREE_NODES},
+};
+
+// Warm up, then time reps runs of c and print the distribution of
+// their nanoseconds per operation, followed by the mean counts per
+// operation when profiling.
+void run_case(const bench_case &c, const bench_params &p,
+              uint64_t warmup, uint64_t reps)
+{
+    bench b(p, c.nodes * p.node_size);
+    uint64_t ops;
+    for (uint64_t i = 0; i < warmup; i++)
+        (b.*c.run)(ops);
+    std::vector<double> samples;
+    uint64_t total_ops = 0;
+    uint64_t totals[PERF_NUM_COUNTERS] = {0};
+    for (uint64_t i = 0; i < reps; i++)
+    {
+        uint64_t elapsed = (b.*c.run)(ops);
+        samples.push_back((double)elapsed / ops);
+        total_ops += ops;
+        for (int k = 0; k < PERF_NUM_COUNTERS; k++)
+            totals[k] += section_counts[k];
+    }
+    std::sort(samples.begin(), samples.end());
+    double mean = 0;
+    for (auto s : samples)
+        mean += s;
+    mean /= samples.size();
+    double var = 0;
+    for (auto s : samples)
+        var += (s - mean) * (s - mean);
+    double stddev = samples.size() > 1 ? sqrt(var / (samples.size() - 1)) : 0;
+    double median = samples.size() % 2 ? samples[samples.size() / 2]
+                                       : (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]) / 2;
+    printf("%-15s %-4s %6lu %6lu %10.1f %10.1f %10.1f %8.1f %10.1f",
+           c.name, p.random_keys ? "rand" : "seq", p.node_size, p.value_size,
+           samples.front(), median, mean, stddev, samples.back());
+    for (int k = 0; bench_profiling && k < PERF_NUM_COUNTERS; k++)
+    {
+        if (bench_counters.available(k))
+            printf(" %13.1f", (double)totals[k] / total_ops);
+        else
+            printf(" %13s", "n/a");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+bool parse_sizes(const char *arg, std::vector<uint64_t> &sizes)
+{
+    sizes.clear();
+    char *term;
+    while (*arg)
+    {
+        sizes.push_back(strtoull(arg, &term, 10));
+        if (term == arg || sizes.back() == 0 || (*term && *term != ','))
+            return false;
+        arg = *term ? term + 1 : term;
+    }
+    return !sizes.empty();
+}
+
+void usage(char *name)
+{
+    std::cout
+        << "Usage: " << name << " [OPTIONS]" << std::endl
+        << "Micro-benchmarks of betree node operations, in ns per operation." << std::endl
+        << std::endl
+        << "Options are" << std::endl
+        << "  -b <case>            one of apply-leaf, apply-internal, split, merge," << std::endl
+        << "                       flush, get-pivot, leaf-query, leaf-find, iterate," << std::endl
+        << "                       scan                               [ default: all ]" << std::endl
+        << "  -N <sizes>           comma-separated node sizes         [ default: " << DEFAULT_BENCH_NODE_SIZES << " ]" << std::endl
+        << "  -V <sizes>           comma-separated value sizes        [ default: " << DEFAULT_BENCH_VALUE_SIZES << " ]" << std::endl
+        << "  -D <distribution>    seq, rand or all                   [ default: all ]" << std::endl
+        << "  -w <runs>            warmup runs, discarded             [ default: " << DEFAULT_BENCH_WARMUP << " ]" << std::endl
+        << "  -r <runs>            timed repetitions                  [ default: " << DEFAULT_BENCH_REPS << " ]" << std::endl
+        << "  -s <seed>            random seed                        [ default: 0 ]" << std::endl
+        << "  -P                   add perf_event_open counts per op  [ default: off ]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    const char *dist = "all";
+    std::vector<uint64_t> node_sizes;
+    std::vector<uint64_t> value_sizes;
+    uint64_t warmup = DEFAULT_BENCH_WARMUP;
+    uint64_t reps = DEFAULT_BENCH_REPS;
+    uint64_t seed = 0;
+    bool defaults_ok = parse_sizes(DEFAULT_BENCH_NODE_SIZES, node_sizes);
+    defaults_ok = parse_sizes(DEFAULT_BENCH_VALUE_SIZES, value_sizes) && defaults_ok;
+    assert(defaults_ok);
+    (void)defaults_ok;
+
+    int opt;
+    char *term;
+
+    while ((opt = getopt(argc, argv, "b:N:V:D:w:r:s:P")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            only = optarg;
+            break;
+        case 'P':
+            bench_profiling = true;
+            break;
+        case 'N':
+            if (!parse_sizes(optarg, node_sizes))
+            {
+                std::cerr << "Argument to -N must be a list of positive integers" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'V':
+            if (!parse_sizes(optarg, value_sizes))
+            {
+                std::cerr << "Argument to -V must be a list of positive integers" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'D':
+            dist = optarg;
+            break;
+        case 'w':
+            warmup = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -w must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'r':
+            reps = strtoull(optarg, &term, 10);
+            if (*term || reps == 0)
+            {
+                std::cerr << "Argument to -r must be a positive integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, &term, 10);
+            if (*term)
+            {
+                std::cerr << "Argument to -s must be an integer" << std::endl;
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (strcmp(dist, "seq") != 0 && strcmp(dist, "rand") != 0 && strcmp(dist, "all") != 0)
+    {
+        std::cerr << "Distribution must be \"seq\", \"rand\" or \"all\"" << std::endl;
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bool found = !only;
+    for (auto &c : cases)
+        found = found || strcmp(only, c.name) == 0;
+    if (!found)
+    {
+        std::cerr << "Unknown case '" << only << "'" << std::endl;
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (bench_profiling && !bench_counters.open())
+    {
+        std::cerr << "perf_event_open: no performance counters available" << std::endl;
+        exit(1);
+    }
+
+    printf("# %-13s %-4s %6s %6s %10s %10s %10s %8s %10s",
+           "case", "keys", "node", "value", "min", "median", "mean", "stddev", "max");
+    for (int k = 0; bench_profiling && k < PERF_NUM_COUNTERS; k++)
+        printf(" %13s", perf_counter_names[k]);
+    printf("\n");
+    for (auto &c : cases)
+    {
+        if (only && strcmp(only, c.name) != 0)
+            continue;
+        for (int random_keys = 0; random_keys < 2; random_keys++)
+        {
+            if (strcmp(dist, random_keys ? "seq" : "rand") == 0)
+                continue;
+            for (auto node_size : node_sizes)
+                for (auto value_size : value_sizes)
+                {
+                    bench_params p = {node_size, (bool)random_keys, value_size, seed};
+                    run_case(c, p, warmup, reps);
+                }
+        }
+    }
+    return 0;
+}